@@ -0,0 +1,501 @@
+#include "http.h"
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+//---------------------------------------------------------------------------------
+// client-ev: fetches many URLs at once from a single thread.  Every connection
+// is non-blocking and one epoll loop drives all of them through connect, send,
+// parse and close, so slow servers overlap instead of adding up.  URLs are
+// queued per host; a host never has more than -c connections open, the whole
+// run never more than -n.  A connection that finishes a keep-alive response
+// takes the next URL queued for its host rather than closing, so most requests
+// after the first few skip the handshake.  Host names are looked up with the
+// blocking resolver once, before the loop starts, so a slow DNS server delays
+// the start of the run rather than stalling connections already in flight.
+//---------------------------------------------------------------------------------
+
+#define  BUFF_SZ            16384
+#define  DEF_PER_HOST       4
+#define  DEF_MAX_CONNS      64
+#define  IO_TIMEOUT_MS      10000       //a connection silent this long fails
+#define  MAX_EVENTS         64
+#define  MAX_REQ_SZ         1024
+
+#define  CONN_CONNECTING    0
+#define  CONN_SENDING       1
+#define  CONN_RECEIVING     2
+
+typedef struct fetch_host {
+    char            name[256];
+    uint16_t        port;
+    struct sockaddr_in addr;
+    bool            bad;                //lookup failed, its URLs fail
+    int             active;             //connections open to it
+    int             head;               //queue of jobs waiting, -1 = empty
+    int             tail;
+} fetch_host;
+
+typedef struct fetch_job {
+    int             host;
+    char            *url;
+    char            *path;
+    int             next;               //next job queued for the same host
+    int             status;             //0 until a response, -1 failed
+    long long       bytes;
+    bool            retried;
+} fetch_job;
+
+typedef struct fetch_conn {
+    int             fd;
+    int             state;
+    int             host;
+    int             job;
+    bool            reused;             //served a response before this job
+    char            req[MAX_REQ_SZ];
+    int             req_len;
+    int             req_off;
+    long long       last_io;            //ms, for the timeout
+    int             slot;               //index in conns
+    bool            keep_alive;
+    http_parser     parser;
+} fetch_conn;
+
+static fetch_host   *hosts;
+static int          nhosts;
+static fetch_job    *jobs;
+static int          njobs;
+static int          jobs_left;
+static int          open_conns;
+static fetch_conn   **conns;            //every open connection, for timeouts
+static int          epfd;
+static char         recv_buff[BUFF_SZ];
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void print_usage(char *exe_name){
+    fprintf(stderr, "Usage: %s [-c per_host] [-n max_conns] [url...]\n", exe_name);
+    fprintf(stderr, "       url is [http://]host[:port][/path], read one per line from stdin when none are given\n");
+    fprintf(stderr, "       -c connections per host, DEFAULT = %d; -n connections in all, DEFAULT = %d\n",
+            DEF_PER_HOST, DEF_MAX_CONNS);
+}
+
+//Finds or adds the host a URL names
+static int host_index(const char *name, int name_len, uint16_t port){
+    for (int i = 0; i < nhosts; i++)
+        if (hosts[i].port == port && strncmp(hosts[i].name, name, name_len) == 0 &&
+            hosts[i].name[name_len] == '\0')
+            return i;
+    fetch_host *grown = realloc(hosts, (nhosts + 1) * sizeof(fetch_host));
+    if (grown == NULL)
+        return -1;
+    hosts = grown;
+    fetch_host *h = &hosts[nhosts];
+    memset(h, 0, sizeof(fetch_host));
+    snprintf(h->name, sizeof(h->name), "%.*s", name_len, name);
+    h->port = port;
+    h->head = h->tail = -1;
+    return nhosts++;
+}
+
+//Splits "http://host:port/path" and queues it on its host
+static int add_job(const char *url){
+    const char *p = url;
+    if (strncmp(p, "http://", 7) == 0)
+        p += 7;
+    const char *slash = strchr(p, '/');
+    const char *host_end = (slash != NULL) ? slash : p + strlen(p);
+    const char *colon = memchr(p, ':', host_end - p);
+    uint16_t port = DEFAULT_PORT;
+    if (colon != NULL) {
+        port = atoi(colon + 1);
+        host_end = colon;
+    }
+    if (host_end == p || host_end - p >= (int)sizeof(hosts[0].name) || port == 0) {
+        fprintf(stderr, "Skipping bad url %s\n", url);
+        return -1;
+    }
+
+    int host = host_index(p, host_end - p, port);
+    fetch_job *grown = (host < 0) ? NULL : realloc(jobs, (njobs + 1) * sizeof(fetch_job));
+    if (grown == NULL) {
+        fprintf(stderr, "Out of memory queueing %s\n", url);
+        return -1;
+    }
+    jobs = grown;
+    fetch_job *j = &jobs[njobs];
+    memset(j, 0, sizeof(fetch_job));
+    j->url = strdup(url);
+    j->path = strdup((slash != NULL) ? slash : DEFAULT_PATH);
+    if (j->url == NULL || j->path == NULL) {
+        fprintf(stderr, "Out of memory queueing %s\n", url);
+        free(j->url);
+        free(j->path);
+        return -1;
+    }
+    j->host = host;
+    j->next = -1;
+    fetch_host *h = &hosts[j->host];
+    if (h->tail >= 0)
+        jobs[h->tail].next = njobs;
+    else
+        h->head = njobs;
+    h->tail = njobs;
+    jobs_left++;
+    return njobs++;
+}
+
+static int next_job(fetch_host *h){
+    int job = h->head;
+    if (job >= 0) {
+        h->head = jobs[job].next;
+        if (h->head < 0)
+            h->tail = -1;
+    }
+    return job;
+}
+
+//A stale keep-alive connection gets its job back at the front of the queue
+static void requeue_job(fetch_host *h, int job){
+    jobs[job].next = h->head;
+    h->head = job;
+    if (h->tail < 0)
+        h->tail = job;
+}
+
+static void job_done(int job, int status){
+    fetch_job *j = &jobs[job];
+    j->status = status;
+    if (status > 0)
+        fprintf(stdout, "%d %lld %s\n", status, j->bytes, j->url);
+    else
+        fprintf(stdout, "FAILED %s\n", j->url);
+    jobs_left--;
+}
+
+static void ev_on_header(void *ctx, const http_response *resp, const char *hbuf){
+    fetch_conn *c = ctx;
+    jobs[c->job].status = resp->status;
+    c->keep_alive = resp->keep_alive;
+}
+
+static void ev_on_body(void *ctx, const char *data, int len){
+    fetch_conn *c = ctx;
+    jobs[c->job].bytes += len;
+}
+
+static const http_callbacks ev_callbacks = {
+    .on_header = ev_on_header,
+    .on_body = ev_on_body,
+    .on_complete = NULL,
+};
+
+static int conn_watch(fetch_conn *c, int op, uint32_t events){
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    return epoll_ctl(epfd, op, c->fd, &ev);
+}
+
+//Gets the connection ready to send the request for job
+static void conn_assign(fetch_conn *c, int job){
+    fetch_job *j = &jobs[job];
+    c->job = job;
+    c->req_len = snprintf(c->req, sizeof(c->req),
+                          "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: Keep-Alive\r\n\r\n",
+                          j->path, hosts[j->host].name);
+    if (c->req_len >= (int)sizeof(c->req))
+        c->req_len = sizeof(c->req) - 1;
+    c->req_off = 0;
+    c->keep_alive = false;
+    j->bytes = 0;
+    j->status = 0;
+    http_parser_init(&c->parser, &ev_callbacks, c);
+}
+
+static void conn_close(fetch_conn *c){
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    hosts[c->host].active--;
+    conns[c->slot] = conns[--open_conns];
+    conns[c->slot]->slot = c->slot;
+    free(c);
+}
+
+//The connection failed with its job unfinished.  A reused keep-alive
+//connection may just have been closed by the server while idle, so its job
+//gets one more try on a fresh connection
+static void conn_fail(fetch_conn *c){
+    fetch_job *j = &jobs[c->job];
+    if (c->reused && !j->retried) {
+        j->retried = true;
+        requeue_job(&hosts[c->host], c->job);
+    } else {
+        job_done(c->job, -1);
+    }
+    conn_close(c);
+}
+
+//Looks up every host once, gethostbyname() blocks so it is kept out of the loop
+static void resolve_hosts(void){
+    for (int i = 0; i < nhosts; i++) {
+        fetch_host *h = &hosts[i];
+        struct hostent *hp = gethostbyname(h->name);
+        if (hp == NULL) {
+            fprintf(stderr, "Cannot resolve %s\n", h->name);
+            h->bad = true;
+            continue;
+        }
+        memset(&h->addr, 0, sizeof(h->addr));
+        memcpy(&h->addr.sin_addr, hp->h_addr_list[0], hp->h_length);
+        h->addr.sin_family = AF_INET;
+        h->addr.sin_port = htons(h->port);
+    }
+}
+
+//Opens a non-blocking connection to host and hands it the host's next job.
+//Returns 0 if it opened, 1 if jobs were used up failing, -1 if nothing changed
+static int conn_open(int host){
+    fetch_host *h = &hosts[host];
+
+    if (h->bad) {
+        int job;
+        while ((job = next_job(h)) >= 0)
+            job_done(job, -1);
+        return 1;
+    }
+
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    fetch_conn *c = malloc(sizeof(fetch_conn));
+    if (c == NULL) {
+        perror("malloc");
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&h->addr, sizeof(h->addr)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        free(c);
+        job_done(next_job(h), -1);
+        return 1;
+    }
+
+    c->fd = fd;
+    c->host = host;
+    c->state = CONN_CONNECTING;
+    c->reused = false;
+    c->last_io = now_ms();
+    conn_assign(c, next_job(h));
+    if (conn_watch(c, EPOLL_CTL_ADD, EPOLLOUT) < 0) {
+        perror("epoll_ctl");
+        close(fd);
+        job_done(c->job, -1);
+        free(c);
+        return 1;
+    }
+    h->active++;
+    c->slot = open_conns;
+    conns[open_conns++] = c;
+    return 0;
+}
+
+//Opens connections for queued jobs while the limits allow.  Hosts are taken
+//round robin from where the last call stopped so one host with thousands of
+//URLs does not keep the others waiting.  A host whose connection could not
+//even be started (out of descriptors, say) is left for a later call
+static void fill_conns(int per_host, int max_conns){
+    static int start = 0;
+    bool progress = true;
+
+    while (progress && open_conns < max_conns) {
+        progress = false;
+        for (int k = 0; k < nhosts && open_conns < max_conns; k++) {
+            int i = (start + k) % nhosts;
+            if (hosts[i].head >= 0 && hosts[i].active < per_host &&
+                conn_open(i) >= 0)
+                progress = true;
+        }
+        start = (nhosts > 0) ? (start + 1) % nhosts : 0;
+    }
+}
+
+static void conn_send(fetch_conn *c){
+    while (c->req_off < c->req_len) {
+        int n = send(c->fd, c->req + c->req_off, c->req_len - c->req_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            conn_fail(c);
+            return;
+        }
+        c->req_off += n;
+    }
+    c->state = CONN_RECEIVING;
+    conn_watch(c, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+//The response is in, keep the connection for the host's next job if it can be
+static void conn_finish(fetch_conn *c){
+    job_done(c->job, jobs[c->job].status);
+    int job = c->keep_alive ? next_job(&hosts[c->host]) : -1;
+    if (job < 0) {
+        conn_close(c);
+        return;
+    }
+    c->reused = true;
+    conn_assign(c, job);
+    c->state = CONN_SENDING;
+    conn_watch(c, EPOLL_CTL_MOD, EPOLLOUT);
+    conn_send(c);
+}
+
+static void conn_recv(fetch_conn *c){
+    while (1) {
+        int n = recv(c->fd, recv_buff, sizeof(recv_buff), 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            conn_fail(c);
+            return;
+        }
+        if (n == 0) {
+            if (http_parser_eof(&c->parser) == 0 && c->parser.state == HTTP_PS_DONE) {
+                c->keep_alive = false;
+                conn_finish(c);
+            } else {
+                conn_fail(c);
+            }
+            return;
+        }
+        //Without pipelining nothing follows the response, extra bytes are junk
+        if (http_parser_feed(&c->parser, recv_buff, n) < 0) {
+            job_done(c->job, -1);
+            conn_close(c);
+            return;
+        }
+        if (c->parser.state == HTTP_PS_DONE) {
+            conn_finish(c);
+            return;
+        }
+    }
+}
+
+static void conn_event(fetch_conn *c, uint32_t events){
+    c->last_io = now_ms();
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            fprintf(stderr, "Cannot connect to %s: %s\n", hosts[c->host].name, strerror(err));
+            conn_fail(c);
+            return;
+        }
+        c->state = CONN_SENDING;
+    }
+    if (c->state == CONN_SENDING)
+        conn_send(c);
+    else
+        conn_recv(c);
+}
+
+//Fails connections that have been silent for IO_TIMEOUT_MS, checked once
+//per epoll_wait() so a dead server can not hold its slots forever
+static void sweep_timeouts(void){
+    long long now = now_ms();
+    for (int i = open_conns - 1; i >= 0; i--) {
+        fetch_conn *c = conns[i];
+        if (now - c->last_io > IO_TIMEOUT_MS) {
+            fprintf(stderr, "Timed out on %s\n", jobs[c->job].url);
+            jobs[c->job].retried = true;
+            conn_fail(c);
+        }
+    }
+}
+
+int main(int argc, char *argv[]){
+    int per_host = DEF_PER_HOST;
+    int max_conns = DEF_MAX_CONNS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:h")) != -1) {
+        switch (opt) {
+            case 'c':
+                per_host = atoi(optarg);
+                break;
+            case 'n':
+                max_conns = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(opt == 'h' ? 0 : -1);
+        }
+    }
+    if (per_host < 1 || max_conns < 1) {
+        print_usage(argv[0]);
+        exit(-1);
+    }
+
+    for (int i = optind; i < argc; i++)
+        add_job(argv[i]);
+    if (optind == argc) {
+        char line[2048];
+        while (fgets(line, sizeof(line), stdin) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0')
+                add_job(line);
+        }
+    }
+
+    resolve_hosts();
+    conns = malloc(max_conns * sizeof(fetch_conn *));
+    if (conns == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(-1);
+    }
+
+    long long start = now_ms();
+    struct epoll_event events[MAX_EVENTS];
+    while (jobs_left > 0) {
+        fill_conns(per_host, max_conns);
+        if (open_conns == 0)
+            break;
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++)
+            conn_event(events[i].data.ptr, events[i].events);
+        sweep_timeouts();
+    }
+
+    int ok = 0;
+    for (int i = 0; i < njobs; i++)
+        ok += (jobs[i].status > 0);
+    fprintf(stdout, "Fetched %d of %d urls from %d hosts in %lld ms\n", ok, njobs, nhosts,
+            now_ms() - start);
+    close(epfd);
+    return (ok == njobs) ? 0 : 1;
+}
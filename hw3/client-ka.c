@@ -9,9 +9,56 @@
 
 #define  BUFF_SZ            1024
 #define  MAX_REOPEN_TRIES   5
+#define  PIPELINE_DEPTH     32      //requests in flight at once when pipelining
+#define  POOL_MAX_TOTAL     16      //connection pool caps, see http_pool_init()
+#define  POOL_MAX_PER_HOST  4
+#define  POOL_IDLE_MS       5000
+#define  POOL_MAX_REQUESTS  100
 
 char recv_buff[BUFF_SZ];
 
+//What the parser callbacks learn about the response being received
+typedef struct ka_response {
+    int     status;
+    bool    keep_alive;
+    int     total_bytes;
+} ka_response;
+
+//The parser keeps the header it is collecting, too big for the stack
+static http_parser ka_parser;
+
+static http_pool ka_pool;
+
+static void ka_on_header(void *ctx, const http_response *resp, const char *hbuf){
+    ka_response *r = ctx;
+    r->status = resp->status;
+    r->keep_alive = resp->keep_alive;
+}
+
+//Body bytes come straight out of recv_buff
+static void ka_on_body(void *ctx, const char *data, int len){
+    ka_response *r = ctx;
+    fprintf(stdout, "%.*s", len, data);
+    r->total_bytes += len;
+}
+
+//A chunked body can end with trailer fields, show them like the header
+static void ka_on_complete(void *ctx, const http_response *resp, const char *hbuf){
+    if (resp->trailer_start < 0)
+        return;
+    for (int i = resp->trailer_start; i < resp->nheaders; i++) {
+        const http_header *h = &resp->headers[i];
+        fprintf(stdout, "TRAILER: %.*s: %.*s\n", h->name_len, hbuf + h->name_off,
+                h->value_len, hbuf + h->value_off);
+    }
+}
+
+static const http_callbacks ka_callbacks = {
+    .on_header = ka_on_header,
+    .on_body = ka_on_body,
+    .on_complete = ka_on_complete,
+};
+
 char *generate_cc_request(const char *host, int port, const char *path){
 	static char req[512] = {0};
 	int offset = 0;
@@ -28,164 +75,201 @@ char *generate_cc_request(const char *host, int port, const char *path){
 
 
 void print_usage(char *exe_name){
-    fprintf(stderr, "Usage: %s <hostname> <port> <path...>\n", exe_name);
+    fprintf(stderr, "Usage: %s [-P] <hostname> <port> <path...>\n", exe_name);
+    fprintf(stderr, "       -P pipelines the requests, they all go out before the responses are read\n");
     fprintf(stderr, "Using default host %s, port %d  and path [\\]\n", DEFAULT_HOST, DEFAULT_PORT); 
 }
 
-int reopen_socket(const char *host, uint16_t port) {
-    int sock = 0;
-
-    //Attempting to connect to the server MAX_REOPEN_TRIES times
-    for (int i = 0; i < MAX_REOPEN_TRIES; i++) {
-        sock = socket_connect(host, port);
-        if (sock >= 0) {
-            return sock;
-        }
-    }
-    
-    //Returning -1 if the socket failed to connect
-    return -1;
-}
-
-int server_connect(const char *host, uint16_t port){
-    return socket_connect(host, port);
-}
-
-void server_disconnect(int sock){
-    close(sock);
+static void print_response(const ka_response *response){
+    fprintf(stdout, "\n\nOK\n");
+    fprintf(stdout, "STATUS: %d\n", response->status);
+    fprintf(stdout, "TOTAL BYTES: %d\n", response->total_bytes);
 }
 
-int submit_request(int sock, const char *host, uint16_t port, char *resource){
-    int sent_bytes = 0; 
-
+int submit_request(const char *host, uint16_t port, char *resource){
     const char *req = generate_cc_request(host, port, resource);
     int send_sz = strlen(req);
+    int sent_bytes = 0; 
+    int bytes_recvd = 0;    //used to track amount of data received on each recv() call
+    ka_response response;
+    http_parser *parser = &ka_parser;
+    bool reused;
+    int sock;
+
+    //A pooled socket passed its health check, but the server can still close
+    //it just as the request goes out.  Then the send() fails or the socket
+    //reads as closed before a byte of the response, either way the request is
+    //sent again on another socket, a new one once the idle ones are used up
+    for (int tries = 0; ; tries++) {
+        sock = http_pool_get(&ka_pool, host, port, &reused);
+        if (sock < 0)
+            return -1;
 
-    // This is the initial send, this is where the send will fail with 
-    // Keep-Alive if the server closed the socket, sent_bytes will have
-    // the number of bytes sent, which should equal send_sz if all went
-    // well.  If sent_bytes < 0, this indicates a send error, so we will
-    // need to reconnect to the server.
-    sent_bytes = send(sock, req, send_sz,0);
-
-    //we have a socket error, perhaps the server closed it, lets try to reopen
-    //the socket
-    if (sent_bytes < 0){
-        //Reopen the socket
-        sock = reopen_socket(host, port);
-        if (sock < 0) {
-            return sock;
+        sent_bytes = send(sock, req, send_sz, MSG_NOSIGNAL);
+        if(sent_bytes != send_sz){
+            http_pool_put(&ka_pool, sock, false);
+            if (reused && tries < MAX_REOPEN_TRIES)
+                continue;
+            if(sent_bytes < 0)
+                perror("send failed");
+            else
+                fprintf(stderr, "Sent bytes %d is not equal to sent size %d\n", sent_bytes, send_sz);
+            return -1;
         }
 
-        //Reissue the send with new socket
-        sent_bytes = send(sock, req, send_sz, 0);
+        //Feed whatever each recv() returns to the parser, the header may well be
+        //split over several of them and the body is framed by the parser
+        memset(&response, 0, sizeof(response));
+        http_parser_init(parser, &ka_callbacks, &response);
+        bytes_recvd = recv(sock, recv_buff, sizeof(recv_buff), 0);
+        if (bytes_recvd <= 0 && reused && tries < MAX_REOPEN_TRIES) {
+            http_pool_put(&ka_pool, sock, false);
+            continue;
+        }
+        break;
     }
 
-    //This should not happen, but just checking if we didnt send everything and 
-    //handling appropriately 
-    if(sent_bytes != send_sz){
-        if(sent_bytes < 0)
-            perror("send failed after reconnect attempt");
-        else
-            fprintf(stderr, "Sent bytes %d is not equal to sent size %d\n", sent_bytes, send_sz);
-        
-        close(sock);
-        return -1;
+    while(1){
+        if(bytes_recvd < 0) {
+            perror("receive failed");
+            http_pool_put(&ka_pool, sock, false);
+            return -1;
+        }
+        //The server closed, fine if the body runs to the close, otherwise
+        //the response was cut short or never started
+        if(bytes_recvd == 0) {
+            if(http_parser_eof(parser) < 0 || parser->state != HTTP_PS_DONE) {
+                fprintf(stderr, "Server closed the connection before the response ended\n");
+                http_pool_put(&ka_pool, sock, false);
+                return -1;
+            }
+            break;
+        }
+        if(http_parser_feed(parser, recv_buff, bytes_recvd) < 0) {
+            http_pool_put(&ka_pool, sock, false);
+            return -1;
+        }
+        if(parser->state == HTTP_PS_DONE)
+            break;
+        bytes_recvd = recv(sock, recv_buff, sizeof(recv_buff), 0);
     }
 
-    int bytes_recvd = 0;    //used to track amount of data received on each recv() call
-    int total_bytes = 0;    //used to accumulate the total number of bytes across all recv() calls
-    
-    //do the first recv
-    bytes_recvd = recv(sock, recv_buff, sizeof(recv_buff),0);
-    if(bytes_recvd < 0) {
-        perror("initial receive failed");
-        close(sock);
-        return -1;
-    }
+    print_response(&response);
 
-    //remember the first receive we just did has the HTTP header, and likely some body
-    //data.  We need to determine how much data we expect
+    //The socket goes back to the pool for the next request, unless the server
+    //said it will close it or already has
+    http_pool_put(&ka_pool, sock, response.keep_alive && bytes_recvd > 0);
+    return 0;
+}
 
-    //Get the header length from the received data
-    int header_len = get_http_header_len(recv_buff, bytes_recvd);
-    if(header_len < 0) {
-        close(sock);
-        return -1;
+
+//Writes the requests for paths[*sent, upto) back to back with one send(),
+//MSG_NOSIGNAL so a server that already closed shows up as an error
+static int send_requests(int sock, const char *host, uint16_t port, char **paths,
+                         int *sent, int upto){
+    static char batch[PIPELINE_DEPTH * 512];
+    int len = 0;
+
+    for (; *sent < upto; (*sent)++) {
+        const char *req = generate_cc_request(host, port, paths[*sent]);
+        int n = strlen(req);
+        memcpy(batch + len, req, n);
+        len += n;
     }
-    
-
-    //--------------------------------------------------------------------------------
-    //TODO:  Get the conetent len
-    //
-    // 1. Use the get_http_content_len() function to set the content_len variable.
-    //
-    // Note that no error checking is needed, if the get_http_content_len() function
-    // cannot find a Content-Length header, its assumed as per the HTTP spec that ther
-    // is no body, AKA, content_len is zero;
-    //--------------------------------------------------------------------------------
-    int content_len = get_http_content_len(recv_buff, bytes_recvd);
-
-    //--------------------------------------------------------------------------------
-    // TODO:  Make sure you understand the calculations below
-    //
-    // You do not have to write any code, but add to this comment your thoughts on 
-    // what the following 2 lines of code do to track the amount of data received
-    // from the server
-    //
-    // YOUR ANSWER:  On line 144, the initial_data variable is calculated by 
-    // subtracting the header_len from the bytes_recvd. This is because we want to
-    // determine the amount of data in that is in the HTTP body. We do this by
-    // subtracting the header_len from the bytes_recvd. Bytes_recvd is the total
-    // number of bytes received from the server, and the header_len is the length
-    // of the HTTP header. The bytes_remaining variable is then calculated by taking
-    // the inital_data variable we just created and subtracting it from the content_len.
-    // This variable shows how many bytes remaining there are to be received from the server.
-    //--------------------------------------------------------------------------------
-    int initial_data =  bytes_recvd - header_len;
-    int bytes_remaining = content_len - initial_data;
-
-
-    //This loop keeps going until bytes_remaining is essentially zero, to be more
-    //defensive an prevent an infinite loop, i have it set to keep looping as long
-    //as bytes_remaining is positive
-    while(bytes_remaining > 0){
-        //Make recv() call to get more data from server
-        bytes_recvd = recv(sock, recv_buff, sizeof(recv_buff), 0);
-        
-        //Check for receive error
-        if(bytes_recvd < 0) {
-            perror("receive failed");
-            close(sock);
+    for (int off = 0; off < len; ) {
+        int n = send(sock, batch + off, len - off, MSG_NOSIGNAL);
+        if (n < 0)
             return -1;
-        }
-        
-        //Print received data and update counters
-        fprintf(stdout, "%.*s", bytes_recvd, recv_buff);
-        total_bytes += bytes_recvd;
-        fprintf(stdout, "remaining %d, received %d\n", bytes_remaining, bytes_recvd);
-        bytes_remaining -= bytes_recvd;
+        off += n;
     }
+    return 0;
+}
 
-    fprintf(stdout, "\n\nOK\n");
-    fprintf(stdout, "TOTAL BYTES: %d\n", total_bytes);
-
-    //processed the request OK, return the socket, in case we had to reopen
-    //so that it can be used in the next request
-
-    //---------------------------------------------------------------------------------
-    // TODO:  Documentation
-    //
-    // You dont have any code to change, but explain why this function, if it gets to this
-    // point returns an active socket.
-    //
-    // YOUR ANSWER: The reason why we are returning an active socket is because up until
-    // this point there have been no errors that would have closed the socket. We have
-    // reached the end of the function and we return the active socket because it allows
-    // the caller of this function to reuse the same socket for other requests it may
-    // decide to make. This helps with not having to repeatedly open and close connections.
-    //--------------------------------------------------------------------------------
-    return sock;
+//---------------------------------------------------------------------------------
+// Pipelined keep-alive.  Instead of a round trip per path, up to PIPELINE_DEPTH
+// requests go out on the connection before any response is read, and every
+// response that completes makes room for the next request.  Responses come
+// back in request order, the parser's framing (Content-Length or chunked) says
+// where each ends and the bytes after that belong to the next one.
+//
+// The server may close the connection at any time, after a response that said
+// Connection: close or just because it had served enough.  The requests it did
+// not answer are sent again on a new connection, so every path is fetched once
+// as long as connections keep making progress.  Returns 0, or -1.
+//---------------------------------------------------------------------------------
+int submit_pipelined(const char *host, uint16_t port, char **paths, int npaths){
+    ka_response response;
+    http_parser *parser = &ka_parser;
+    int done = 0, tries = 0;
+
+    while (done < npaths) {
+        int sock = http_pool_get(&ka_pool, host, port, NULL);
+        if (sock < 0)
+            return -1;
+
+        int sent = done, answered = 0;
+        bool closing = false;
+        memset(&response, 0, sizeof(response));
+        http_parser_init(parser, &ka_callbacks, &response);
+        int upto = (done + PIPELINE_DEPTH < npaths) ? done + PIPELINE_DEPTH : npaths;
+        if (send_requests(sock, host, port, paths, &sent, upto) < 0)
+            sent = done;
+
+        while (done < sent && !closing) {
+            int bytes_recvd = recv(sock, recv_buff, sizeof(recv_buff), 0);
+            if (bytes_recvd <= 0) {
+                //A body that runs to the close is complete now, anything else
+                //that was in flight is asked for again
+                if (bytes_recvd == 0 && http_parser_eof(parser) == 0 &&
+                    parser->state == HTTP_PS_DONE) {
+                    print_response(&response);
+                    done++;
+                    answered++;
+                }
+                break;
+            }
+            for (int off = 0; off < bytes_recvd && !closing; ) {
+                int used = http_parser_feed(parser, recv_buff + off, bytes_recvd - off);
+                if (used < 0) {
+                    http_pool_put(&ka_pool, sock, false);
+                    return -1;
+                }
+                off += used;
+                if (parser->state != HTTP_PS_DONE)
+                    break;
+                print_response(&response);
+                done++;
+                answered++;
+
+                //The server closes after this one, what follows will not be answered
+                if (!response.keep_alive) {
+                    closing = true;
+                    break;
+                }
+                memset(&response, 0, sizeof(response));
+                http_parser_reset(parser);
+                upto = (done + PIPELINE_DEPTH < npaths) ? done + PIPELINE_DEPTH : npaths;
+                if (sent < upto && send_requests(sock, host, port, paths, &sent, upto) < 0)
+                    closing = true;
+            }
+        }
+        if (done == npaths && !closing) {
+            http_pool_put(&ka_pool, sock, true);
+            break;
+        }
+
+        //The connection is finished, reissue what it did not answer on a new one
+        http_pool_put(&ka_pool, sock, false);
+        tries = (answered > 0) ? 0 : tries + 1;
+        if (tries >= MAX_REOPEN_TRIES) {
+            fprintf(stderr, "Server keeps closing the connection, %d of %d requests unanswered\n",
+                    npaths - done, npaths);
+            return -1;
+        }
+        if (done < npaths)
+            fprintf(stderr, "Server closed the connection, reissuing %d requests\n", npaths - done);
+    }
+    return 0;
 }
 
 
@@ -195,21 +279,34 @@ int submit_request(int sock, const char *host, uint16_t port, char *resource){
 int main(int argc, char *argv[]){
     clock_t start_time = clock();
 
-    int sock;
-
     const char *host = DEFAULT_HOST;
     uint16_t   port = DEFAULT_PORT;
     char       *resource = DEFAULT_PATH;
     int        remaining_args = 0;
+    bool       pipelined = false;
+
+    //-P comes before the usual arguments, the rest of main sees them as always
+    if(argc > 1 && strcmp(argv[1], "-P") == 0){
+        pipelined = true;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    //Sockets are kept open for reuse between requests, see http_pool_get()
+    if(http_pool_init(&ka_pool, POOL_MAX_TOTAL, POOL_MAX_PER_HOST, POOL_IDLE_MS,
+                      POOL_MAX_REQUESTS) < 0){
+        perror("connection pool");
+        return -1;
+    }
 
     //YOU DONT NEED TO DO ANYTHING OR MODIFY ANYTHING IN MAIN().  MAKE SURE YOU UNDERSTAND
     //THE CODE HOWEVER
-    sock = server_connect(host, port);
 
     if(argc < 4){
         print_usage(argv[0]);
         //process the default request
-        submit_request(sock, host, port, resource);
+        submit_request(host, port, resource);
 	} else {
         host = argv[1];
         port = atoi(argv[2]);
@@ -220,14 +317,18 @@ int main(int argc, char *argv[]){
         }
         fprintf(stdout, "Running with host = %s, port = %d\n", host, port);
         remaining_args = argc-3;
-        for(int i = 0; i < remaining_args; i++){
+        if(pipelined)
+            submit_pipelined(host, port, &argv[3], remaining_args);
+        for(int i = 0; i < remaining_args && !pipelined; i++){
             resource = argv[3+i];
             //fprintf(stdout, "\n\nProcessing request for %s\n\n", resource);
-            sock = submit_request(sock, host, port, resource);
+            submit_request(host, port, resource);
         }
     }
 
-    server_disconnect(sock);
+    fprintf(stdout, "Connections opened: %d, idle connections reused: %d\n",
+            ka_pool.opened, ka_pool.reused);
+    http_pool_destroy(&ka_pool);
 
     clock_t end_time = clock();
     double elapsed_time = (double)(end_time - start_time) / CLOCKS_PER_SEC;
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #define     DEFAULT_HOST    "httpbin.org"
 #define     DEFAULT_PORT    80
@@ -18,12 +19,108 @@
 //and the spec states the end of the headers is \r\n - so there will be 2 in a row
 #define     HTTP_HEADER_END "\r\n\r\n"      
 
+//Headers the parser keeps a view of, the ones after that are still scanned
+//for the fields below but not recorded
+#define     HTTP_MAX_HEADERS 64
+
+//A header as offsets into the buffer it was parsed from, nothing is copied.
+//The value has the whitespace around it trimmed off
+typedef struct http_header {
+    int     name_off;
+    int     name_len;
+    int     value_off;
+    int     value_len;
+} http_header;
+
+//What http_parse_header() found in a response header
+typedef struct http_response {
+    int     status;                 //e.g. 200
+    int     minor_version;          //HTTP/1.x
+    int     header_len;             //bytes up to and including the blank line
+    int     content_len;            //-1 when there is no Content-Length
+    bool    chunked;                //Transfer-Encoding ends in chunked
+    bool    keep_alive;             //connection stays open after this response
+    int     nheaders;
+    int     trailer_start;          //headers from here on are trailers, -1 for none
+    http_header headers[HTTP_MAX_HEADERS];
+} http_response;
+
+//Streaming parser states
+#define     HTTP_PS_HEADER   0          //collecting the header
+#define     HTTP_PS_BODY     1          //body_left bytes of body to go
+#define     HTTP_PS_EOF_BODY 2          //body runs until the server closes
+#define     HTTP_PS_DONE     3
+#define     HTTP_PS_ERROR    4
+#define     HTTP_PS_CHUNK_SIZE 5        //reading a chunk size line
+#define     HTTP_PS_CHUNK_DATA 6        //body_left bytes of the chunk to go
+#define     HTTP_PS_CHUNK_END  7        //the CRLF after a chunk
+#define     HTTP_PS_TRAILER    8        //trailer fields after the last chunk
+
+//Largest header the streaming parser accepts
+#define     HTTP_MAX_HEADER_SZ 16384
+
+//What the streaming parser calls as a response goes by, any may be NULL.
+//hbuf holds the header the views in resp point into, and by on_complete()
+//the trailers of a chunked body as well
+typedef struct http_callbacks {
+    void (*on_header)(void *ctx, const http_response *resp, const char *hbuf);
+    void (*on_body)(void *ctx, const char *data, int len);
+    void (*on_complete)(void *ctx, const http_response *resp, const char *hbuf);
+} http_callbacks;
+
+//Parses one response fed to it in pieces of any size, see http_parser_feed()
+typedef struct http_parser {
+    int         state;
+    const http_callbacks *cb;
+    void        *ctx;
+    http_response resp;
+    char        hbuf[HTTP_MAX_HEADER_SZ];
+    int         hlen;                   //header bytes collected so far
+    int         line_start;             //scan state, where the current line began
+    int         colon;                  //and its first ':', -1 for none yet
+    long long   body_left;
+    int         chunk_digits;           //hex digits of the chunk size so far
+    bool        chunk_ext;              //in a chunk extension, skipped
+} http_parser;
+
+//Keep-alive sockets kept open between requests, keyed by host and port
+#define     HTTP_POOL_HOST_SZ 256
+
+typedef struct http_pool_conn {
+    int         fd;                     //-1 = free slot
+    char        host[HTTP_POOL_HOST_SZ];
+    uint16_t    port;
+    bool        in_use;                 //handed out, not back yet
+    int         requests;               //responses it has carried
+    long long   idle_since;             //ms, when it was last put back
+} http_pool_conn;
+
+typedef struct http_pool {
+    http_pool_conn *conns;
+    int         max_total;              //sockets open at once, all hosts
+    int         max_per_host;
+    int         idle_timeout_ms;        //idle longer than this is closed
+    int         max_requests;           //closed after this many, 0 = no limit
+    int         opened;                 //connections made
+    int         reused;                 //idle connections handed out again
+} http_pool;
+
 //Exported funcitons
 int socket_connect(const char *host, uint16_t port);
 int get_http_header_len(char *http_buff, int http_buff_len);
 int get_http_content_len(char *http_buff, int http_buff_len);
 int process_http_header(char *http_buff, int http_buff_len, int *header_len, int *content_len);
 void print_header(char *http_buff, int http_header_len);
+int http_parse_header(const char *http_buff, int http_buff_len, http_response *resp);
+void http_parser_init(http_parser *p, const http_callbacks *cb, void *ctx);
+void http_parser_reset(http_parser *p);
+int http_parser_feed(http_parser *p, const char *data, int len);
+int http_parser_eof(http_parser *p);
+int http_pool_init(http_pool *pool, int max_total, int max_per_host, int idle_timeout_ms,
+                   int max_requests);
+int http_pool_get(http_pool *pool, const char *host, uint16_t port, bool *reused);
+void http_pool_put(http_pool *pool, int fd, bool reusable);
+void http_pool_destroy(http_pool *pool);
 
 //Utilities
 char *strnstr(const char *s, const char *find, size_t slen);
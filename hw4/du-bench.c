@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/*
+ *  du-bench: runs du-ftp transfers over loopback against synthetic files and
+ *  reports what they cost.  For every file kind and size it writes the file
+ *  into ./outfile, starts a single session du-ftp server, uploads the file
+ *  with a du-ftp client and checks that ./infile ends up with the same bytes.
+ *  Both sides run quiet (-q) and print a STATS line at the end, the table is
+ *  built from those plus the CPU time wait4() reports for each process.
+ *
+ *  Extra arguments for the client (-x) and server (-X) are passed through,
+ *  e.g. -x "-z -W 64" to time compressed transfers with a bigger window.
+ */
+#define BENCH_DEF_SIZES     "tiny,4k,1m"
+#define BENCH_DEF_KINDS     "text,random,zero"
+#define BENCH_DEF_RUNS      3
+#define BENCH_DEF_PORT      2090
+#define BENCH_MAX_RUNS      32
+#define BENCH_MAX_ARGS      32
+#define BENCH_TINY_SIZE     100
+#define BENCH_START_WAIT_MS 2000
+
+typedef struct bench_config {
+    char    sizes[256];
+    char    kinds[256];
+    int     runs;
+    int     port;
+    char    client_args[256];
+    char    server_args[256];
+} bench_config;
+
+//What one transfer cost, from the client's STATS line and wait4()
+typedef struct bench_result {
+    bool    ok;
+    double  wall_ms;
+    double  client_cpu_ms;
+    double  server_cpu_ms;
+    long long pdus;                 //du-ftp messages both ways, client side
+    long long dgrams;
+    long long syscalls;             //client and server
+} bench_result;
+
+static void usage(const char *prog){
+    printf("USAGE: %s [-s sizes] [-k kinds] [-r runs] [-p port] [-x client_args] [-X server_args] [-h]\n", prog);
+    printf("WHERE:\n\t[-s sizes] comma separated, tiny (%d bytes) or a number with an optional k/m/g\n",
+           BENCH_TINY_SIZE);
+    printf("\t           suffix, e.g. tiny,4k,1m,1g; DEFAULT = %s\n", BENCH_DEF_SIZES);
+    printf("\t[-k kinds] comma separated from text, random, zero; DEFAULT = %s\n", BENCH_DEF_KINDS);
+    printf("\t[-r runs] transfers per size and kind, the median is reported; DEFAULT = %d\n", BENCH_DEF_RUNS);
+    printf("\t[-p port] port the server listens on; DEFAULT = %d\n", BENCH_DEF_PORT);
+    printf("\t[-x client_args] extra du-ftp arguments for the client, e.g. \"-z -W 64\"\n");
+    printf("\t[-X server_args] extra du-ftp arguments for the server\n");
+    printf("\t[-h] displays what you are looking at now - the help\n\n");
+}
+
+static void initParams(int argc, char *argv[], bench_config *cfg){
+    int option;
+
+    snprintf(cfg->sizes, sizeof(cfg->sizes), "%s", BENCH_DEF_SIZES);
+    snprintf(cfg->kinds, sizeof(cfg->kinds), "%s", BENCH_DEF_KINDS);
+    cfg->runs = BENCH_DEF_RUNS;
+    cfg->port = BENCH_DEF_PORT;
+    cfg->client_args[0] = '\0';
+    cfg->server_args[0] = '\0';
+
+    while ((option = getopt(argc, argv, ":s:k:r:p:x:X:h")) != -1){
+        switch(option) {
+            case 's':
+                snprintf(cfg->sizes, sizeof(cfg->sizes), "%s", optarg);
+                break;
+            case 'k':
+                snprintf(cfg->kinds, sizeof(cfg->kinds), "%s", optarg);
+                break;
+            case 'r':
+                cfg->runs = atoi(optarg);
+                if (cfg->runs < 1 || cfg->runs > BENCH_MAX_RUNS) {
+                    fprintf(stderr, "Runs must be between 1 and %d\n", BENCH_MAX_RUNS);
+                    exit(-1);
+                }
+                break;
+            case 'p':
+                cfg->port = atoi(optarg);
+                break;
+            case 'x':
+                snprintf(cfg->client_args, sizeof(cfg->client_args), "%s", optarg);
+                break;
+            case 'X':
+                snprintf(cfg->server_args, sizeof(cfg->server_args), "%s", optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case ':':
+                fprintf(stderr, "Option -%c missing value\n", optopt);
+                exit(-1);
+            default:
+                fprintf(stderr, "Unknown option -%c\n", optopt);
+                exit(-1);
+        }
+    }
+}
+
+//"tiny", or a byte count with an optional k/m/g suffix, -1 if it is neither
+static int64_t parse_size(const char *s){
+    char *end;
+
+    if (strcmp(s, "tiny") == 0)
+        return BENCH_TINY_SIZE;
+    int64_t n = strtoll(s, &end, 10);
+    if (end == s || n < 0)
+        return -1;
+    switch (*end) {
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'm': case 'M': n <<= 20; end++; break;
+        case 'g': case 'G': n <<= 30; end++; break;
+    }
+    return (*end == '\0') ? n : -1;
+}
+
+/*
+ *  Writes a synthetic file.  text is words drawn from a small vocabulary so
+ *  it compresses about like prose, random does not compress at all and zero
+ *  is written out block by block (allocated, not a hole).  The generators
+ *  are seeded so every run of a size and kind sends the same bytes.
+ */
+static int make_file(const char *path, const char *kind, int64_t size){
+    static const char *words[] = {
+        "the", "protocol", "sends", "a", "datagram", "and", "waits", "for",
+        "its", "acknowledgement", "before", "window", "of", "server", "client",
+        "file", "block", "offset", "checkpoint", "transfer", "is", "complete",
+    };
+    const int nwords = sizeof(words) / sizeof(words[0]);
+    char buff[65536];
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    struct stat st;
+
+    //A file from an earlier run is reused, the contents only depend on the name
+    if (stat(path, &st) == 0 && st.st_size == size)
+        return 0;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    for (int64_t left = size; left > 0; ) {
+        int n = (left < (int64_t)sizeof(buff)) ? left : (int)sizeof(buff);
+        if (strcmp(kind, "zero") == 0) {
+            memset(buff, 0, n);
+        } else if (strcmp(kind, "random") == 0) {
+            for (int i = 0; i < n; i++) {
+                //xorshift64
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                buff[i] = (char)(x >> 24);
+            }
+        } else {
+            int i = 0;
+            while (i < n) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                const char *w = words[x % nwords];
+                for (int j = 0; w[j] != '\0' && i < n; j++)
+                    buff[i++] = w[j];
+                if (i < n)
+                    buff[i++] = (x >> 32) % 11 == 0 ? '\n' : ' ';
+            }
+        }
+        if (fwrite(buff, 1, n, f) != (size_t)n) {
+            fclose(f);
+            return -1;
+        }
+        left -= n;
+    }
+    return fclose(f);
+}
+
+static bool same_file(const char *a, const char *b){
+    char ba[65536], bb[65536];
+    FILE *fa = fopen(a, "r");
+    FILE *fb = fopen(b, "r");
+    bool same = (fa != NULL && fb != NULL);
+
+    while (same) {
+        size_t na = fread(ba, 1, sizeof(ba), fa);
+        size_t nb = fread(bb, 1, sizeof(bb), fb);
+        if (na != nb || memcmp(ba, bb, na) != 0)
+            same = false;
+        if (na == 0)
+            break;
+    }
+    if (fa != NULL)
+        fclose(fa);
+    if (fb != NULL)
+        fclose(fb);
+    return same;
+}
+
+//Splits extra on spaces into argv after the fixed arguments, NULL terminated
+static void add_args(char **argv, int *argc, char *extra){
+    for (char *tok = strtok(extra, " "); tok != NULL && *argc < BENCH_MAX_ARGS - 1;
+         tok = strtok(NULL, " "))
+        argv[(*argc)++] = tok;
+    argv[*argc] = NULL;
+}
+
+static pid_t spawn(char **argv, const char *out_path){
+    //Gone before the fork, a reader must never see the last run's output
+    unlink(out_path);
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+    execv(argv[0], argv);
+    perror("exec du-ftp");
+    _exit(127);
+}
+
+//Waits until the server says it is up, the client has no CONNECT retry
+static bool wait_for_line(const char *path, const char *needle, pid_t pid){
+    char line[512];
+
+    for (int waited = 0; waited < BENCH_START_WAIT_MS; waited += 10) {
+        FILE *f = fopen(path, "r");
+        if (f != NULL) {
+            while (fgets(line, sizeof(line), f) != NULL) {
+                if (strstr(line, needle) != NULL) {
+                    fclose(f);
+                    return true;
+                }
+            }
+            fclose(f);
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return false;
+        usleep(10000);
+    }
+    return false;
+}
+
+//Picks "key=value" out of the last STATS line in path
+static double stat_value(const char *path, const char *key){
+    char line[1024], last[1024] = "";
+    char pattern[64];
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "STATS ", 6) == 0)
+            snprintf(last, sizeof(last), "%s", line);
+    }
+    fclose(f);
+
+    snprintf(pattern, sizeof(pattern), " %s=", key);
+    char *pos = strstr(last, pattern);
+    return (pos != NULL) ? atof(pos + strlen(pattern)) : -1;
+}
+
+static double rusage_ms(const struct rusage *ru){
+    return ru->ru_utime.tv_sec * 1000.0 + ru->ru_utime.tv_usec / 1000.0 +
+           ru->ru_stime.tv_sec * 1000.0 + ru->ru_stime.tv_usec / 1000.0;
+}
+
+/*
+ *  One transfer: server up, client run, server reaped.  A server that does
+ *  not finish its session on its own (extra arguments can make it long
+ *  running) is stopped once the client is done.
+ */
+static bench_result run_once(bench_config *cfg, const char *fname){
+    bench_result res = { .ok = false };
+    char port[16], server_extra[256], client_extra[256];
+    char *sargv[BENCH_MAX_ARGS], *cargv[BENCH_MAX_ARGS];
+    int sargc = 0, cargc = 0;
+    struct rusage sru, cru;
+    char in_path[512], out_path[512];
+    int status;
+
+    snprintf(port, sizeof(port), "%d", cfg->port);
+    snprintf(server_extra, sizeof(server_extra), "%s", cfg->server_args);
+    snprintf(client_extra, sizeof(client_extra), "%s", cfg->client_args);
+    snprintf(in_path, sizeof(in_path), "./infile/%s", fname);
+    snprintf(out_path, sizeof(out_path), "./outfile/%s", fname);
+    unlink(in_path);
+
+    sargv[sargc++] = "./du-ftp";
+    sargv[sargc++] = "-s";
+    sargv[sargc++] = "-q";
+    sargv[sargc++] = "-p";
+    sargv[sargc++] = port;
+    add_args(sargv, &sargc, server_extra);
+
+    cargv[cargc++] = "./du-ftp";
+    cargv[cargc++] = "-c";
+    cargv[cargc++] = "-q";
+    cargv[cargc++] = "-p";
+    cargv[cargc++] = port;
+    cargv[cargc++] = "-f";
+    cargv[cargc++] = (char *)fname;
+    add_args(cargv, &cargc, client_extra);
+
+    pid_t server = spawn(sargv, "/tmp/du-bench-server.log");
+    if (!wait_for_line("/tmp/du-bench-server.log", "Server listening", server)) {
+        printf("ERROR: du-ftp server did not start, see /tmp/du-bench-server.log\n");
+        kill(server, SIGKILL);
+        wait4(server, &status, 0, &sru);
+        return res;
+    }
+
+    pid_t client = spawn(cargv, "/tmp/du-bench-client.log");
+    wait4(client, &status, 0, &cru);
+    for (int waited = 0; ; waited += 10) {
+        siginfo_t info = { .si_pid = 0 };
+        if (waitid(P_PID, server, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid != 0)
+            break;
+        if (waited == BENCH_START_WAIT_MS)
+            kill(server, SIGTERM);
+        usleep(10000);
+    }
+    wait4(server, &status, 0, &sru);
+
+    res.wall_ms = stat_value("/tmp/du-bench-client.log", "wall_ms");
+    res.pdus = stat_value("/tmp/du-bench-client.log", "pdus_sent") +
+               stat_value("/tmp/du-bench-client.log", "pdus_rcvd");
+    res.dgrams = stat_value("/tmp/du-bench-client.log", "dgrams_sent") +
+                 stat_value("/tmp/du-bench-client.log", "dgrams_rcvd");
+    res.syscalls = stat_value("/tmp/du-bench-client.log", "syscalls") +
+                   stat_value("/tmp/du-bench-server.log", "syscalls");
+    res.client_cpu_ms = rusage_ms(&cru);
+    res.server_cpu_ms = rusage_ms(&sru);
+    res.ok = res.wall_ms >= 0 && same_file(out_path, in_path);
+    return res;
+}
+
+static int by_wall(const void *a, const void *b){
+    const bench_result *ra = a, *rb = b;
+    return (ra->wall_ms > rb->wall_ms) - (ra->wall_ms < rb->wall_ms);
+}
+
+int main(int argc, char *argv[]){
+    bench_config cfg;
+    bench_result results[BENCH_MAX_RUNS];
+    char kinds[256], sizes[256];
+    char *kind_save, *size_save;
+    int failures = 0;
+
+    initParams(argc, argv, &cfg);
+    if (access("./du-ftp", X_OK) < 0) {
+        printf("ERROR: ./du-ftp not found, build it first\n");
+        exit(-1);
+    }
+    mkdir("./infile", 0755);
+    mkdir("./outfile", 0755);
+
+    printf("%-7s %12s %10s %10s %10s %10s %10s %10s %5s\n", "kind", "bytes", "wall_ms",
+           "MB/s", "cli_cpu", "svr_cpu", "syscalls", "pdus", "ok");
+
+    snprintf(kinds, sizeof(kinds), "%s", cfg.kinds);
+    for (char *kind = strtok_r(kinds, ",", &kind_save); kind != NULL;
+         kind = strtok_r(NULL, ",", &kind_save)) {
+        snprintf(sizes, sizeof(sizes), "%s", cfg.sizes);
+        for (char *size_s = strtok_r(sizes, ",", &size_save); size_s != NULL;
+             size_s = strtok_r(NULL, ",", &size_save)) {
+            char fname[128], path[256];
+            int64_t size = parse_size(size_s);
+            if (size < 0) {
+                printf("ERROR: Bad size %s\n", size_s);
+                exit(-1);
+            }
+            snprintf(fname, sizeof(fname), "bench-%s-%s.bin", kind, size_s);
+            snprintf(path, sizeof(path), "./outfile/%s", fname);
+            if (make_file(path, kind, size) < 0) {
+                printf("ERROR: Cannot create %s\n", path);
+                exit(-1);
+            }
+
+            bool ok = true;
+            for (int r = 0; r < cfg.runs; r++) {
+                results[r] = run_once(&cfg, fname);
+                ok = ok && results[r].ok;
+            }
+            qsort(results, cfg.runs, sizeof(bench_result), by_wall);
+            bench_result *med = &results[cfg.runs / 2];
+            double mbs = (med->wall_ms > 0) ? (size / 1048576.0) / (med->wall_ms / 1000.0) : 0;
+            printf("%-7s %12lld %10.2f %10.2f %10.2f %10.2f %10lld %10lld %5s\n", kind,
+                   (long long)size, med->wall_ms, mbs, med->client_cpu_ms, med->server_cpu_ms,
+                   med->syscalls, med->pdus, ok ? "yes" : "NO");
+            fflush(stdout);
+            if (!ok)
+                failures++;
+        }
+    }
+    return (failures == 0) ? 0 : 1;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h> 
 #include <string.h>
@@ -5,16 +6,32 @@
 #include <stdbool.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "du-ftp.h"
 #include "du-proto.h"
+#include "du-io.h"
+#include "du-hash.h"
+#include "du-lz.h"
+#include "du-store.h"
+#include "du-metrics.h"
 
-#define BUFF_SZ DUFTP_MAX_DATA_SIZE
-static char sbuffer[BUFF_SZ];
-static char rbuffer[BUFF_SZ];
+#define BUFF_SZ DUFTP_MAX_MSG_SZ
+
+//Client side state.  The client runs a single transfer, every server session
+//allocates its own buffers and keeps its own sequence number
+static char sbuffer[BUFF_SZ] __attribute__((aligned(8)));
+static char rbuffer[BUFF_SZ] __attribute__((aligned(8)));
 static char full_file_path[FNAME_SZ];
 static int sequence_number = 0;
 
+//Progress of every transfer this process runs, sampled by the reporter thread
+static dumetrics metrics;
+
 /*
  *  Helper function that processes the command line arguements.  Highlights
  *  how to use a very useful utility called getopt, where you pass it a
@@ -35,8 +52,19 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
     cfg->port_number = DEF_PORT_NO;
     strcpy(cfg->file_name, PROG_DEF_FNAME);
     strcpy(cfg->svr_ip_addr, PROG_DEF_SVR_ADDR);
+    cfg->workers = PROG_DEF_WORKERS;
+    cfg->window = PROG_DEF_WINDOW;
+    cfg->get_file = false;
+    cfg->delta = false;
+    cfg->compress = false;
+    cfg->dedup = false;
+    cfg->quiet = false;
+    cfg->interval_ms = DUMETRICS_DEF_INTERVAL_MS;
+    cfg->metrics_path[0] = '\0';
+    cfg->stripes = 1;
+    cfg->sessions = PROG_DEF_SESSIONS;
     
-    while ((option = getopt(argc, argv, ":p:f:a:csh")) != -1){
+    while ((option = getopt(argc, argv, ":p:f:a:w:W:n:S:i:M:gdDzqcsh")) != -1){
         switch(option) {
             case 'p':
                 strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
@@ -48,6 +76,63 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
             case 'a':
                 strncpy(cfg->svr_ip_addr, optarg, sizeof(cfg->svr_ip_addr));
                 break;
+            case 'w':
+                strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
+                cfg->workers = atoi(cmdBuffer);
+                if (cfg->workers <= 0)
+                    cfg->workers = sysconf(_SC_NPROCESSORS_ONLN);
+                break;
+            case 'W':
+                strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
+                cfg->window = atoi(cmdBuffer);
+                if (cfg->window < 1 || cfg->window > DP_MAX_WINDOW) {
+                    fprintf(stderr, "Window must be between 1 and %d\n", DP_MAX_WINDOW);
+                    exit(-1);
+                }
+                break;
+            case 'n':
+                strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
+                cfg->sessions = atoi(cmdBuffer);
+                if (cfg->sessions < 1) {
+                    fprintf(stderr, "Sessions must be at least 1\n");
+                    exit(-1);
+                }
+                break;
+            case 'S':
+                strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
+                cfg->stripes = atoi(cmdBuffer);
+                if (cfg->stripes < 1 || cfg->stripes > DUFTP_MAX_STRIPES) {
+                    fprintf(stderr, "Stripes must be between 1 and %d\n", DUFTP_MAX_STRIPES);
+                    exit(-1);
+                }
+                break;
+            case 'i':
+                strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
+                cfg->interval_ms = atoi(cmdBuffer);
+                if (cfg->interval_ms < 0) {
+                    fprintf(stderr, "Interval must be 0 or more milliseconds\n");
+                    exit(-1);
+                }
+                break;
+            case 'M':
+                strncpy(cfg->metrics_path, optarg, sizeof(cfg->metrics_path) - 1);
+                cfg->metrics_path[sizeof(cfg->metrics_path) - 1] = '\0';
+                break;
+            case 'g':
+                cfg->get_file = true;
+                break;
+            case 'd':
+                cfg->delta = true;
+                break;
+            case 'D':
+                cfg->dedup = true;
+                break;
+            case 'z':
+                cfg->compress = true;
+                break;
+            case 'q':
+                cfg->quiet = true;
+                break;
             case 'c':
                 cfg->prog_mode = PROG_MD_CLI;
                 break;
@@ -55,11 +140,28 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
                 cfg->prog_mode = PROG_MD_SVR;
                 break;
             case 'h':
-                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-s] [-c] [-h]\n", argv[0]);
+                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-w workers] [-W window] [-n sessions] [-S stripes] [-i interval_ms] [-M metrics_file] [-g] [-d] [-D] [-z] [-q] [-s] [-c] [-h]\n", argv[0]);
                 printf("WHERE:\n\t[-c] runs in client mode, [-s] runs in server mode; DEFAULT= client_mode\n");
                 printf("\t[-a svr_addr] specifies the servers IP address as a string; DEFAULT = %s\n", cfg->svr_ip_addr);
                 printf("\t[-p portnum] specifies the port number; DEFAULT = %d\n", cfg->port_number);
-                printf("\t[-f fname] specifies the filename to send or recv; DEFAULT = %s\n", cfg->file_name);
+                printf("\t[-f fname] specifies the filename to send or recv, a directory is sent with\n");
+                printf("\t           everything below it; DEFAULT = %s\n", cfg->file_name);
+                printf("\t[-w workers] server keeps running with one SO_REUSEPORT socket and thread per worker,\n");
+                printf("\t             0 means one per core; DEFAULT = single session then exit\n");
+                printf("\t[-W window] datagrams du-proto may send before waiting for an ACK, 1 = stop and wait; DEFAULT = %d\n", cfg->window);
+                printf("\t[-n sessions] server keeps running and serves up to this many clients at once, each\n");
+                printf("\t             session on its own port and pool thread; DEFAULT = off\n");
+                printf("\t[-S stripes] client uploads fname over this many connections at once, the\n");
+                printf("\t             server needs -n of at least as many; DEFAULT = 1\n");
+                printf("\t[-i interval_ms] how often a progress line is printed, 0 = only the summary\n");
+                printf("\t             at the end; DEFAULT = %d\n", cfg->interval_ms);
+                printf("\t[-M metrics_file] also rewrite the progress numbers into this file at every\n");
+                printf("\t             interval, one \"name value\" per line; DEFAULT = off\n");
+                printf("\t[-g] client downloads fname from the server instead of uploading it\n");
+                printf("\t[-d] client sends only what differs from the server's copy of fname\n");
+                printf("\t[-D] client skips the chunks of fname the server already has stored\n");
+                printf("\t[-z] client offers per block compression for the transfer\n");
+                printf("\t[-q] quiet, no du-proto datagram dumps, for timing runs\n");
                 printf("\t[-p] displays what you are looking at now - the help\n\n");
                 exit(0);
             case ':':
@@ -74,290 +176,2373 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
     return cfg->prog_mode;
 }
 
-int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_sz){
-    int rcvSz;
-    duftp_pdu recv_pdu;
-    duftp_pdu send_pdu;
-    FILE *f = NULL;
-    char output_filename[FNAME_SZ];
-    int total_bytes_received = 0;
-    int expected_seq_num = 0;
+/*
+ *  PDU encoding helpers.  On the wire a du-ftp message is the fixed duftp_pdu
+ *  header followed by fname_len filename bytes (NUL included) and then
+ *  data_size data bytes.  Nothing else is sent, so a control message is just
+ *  the header.  Messages are built in place in the send buffer and decoded in
+ *  place in the receive buffer, the filename and data are never copied out.
+ */
+static duftp_pdu *duftp_init_pdu(void *buff, int msg_type, int seq_num){
+    duftp_pdu *pdu = buff;
+    memset(pdu, 0, sizeof(duftp_pdu));
+    pdu->msg_type = msg_type;
+    pdu->protocol_ver = DUFTP_PROTOCOL_VER;
+    pdu->seq_num = seq_num;
+    return pdu;
+}
 
-    if (dpc->isConnected == false){
-        perror("Expecting the protocol to be in connect state, but its not");
-        exit(-1);
+static char *duftp_data(duftp_pdu *pdu){
+    return (char *)(pdu + 1) + pdu->fname_len;
+}
+
+static void duftp_set_filename(duftp_pdu *pdu, const char *fname){
+    char *dst = (char *)(pdu + 1);
+    int len = strnlen(fname, FNAME_SZ - 1);
+    memcpy(dst, fname, len);
+    dst[len] = '\0';
+    pdu->fname_len = len + 1;
+}
+
+static int duftp_send(dp_connp dpc, duftp_pdu *pdu){
+    return dpsend(dpc, pdu, sizeof(duftp_pdu) + pdu->fname_len + pdu->data_size);
+}
+
+//Sends a message whose data lives elsewhere, e.g. in a file mapping
+static int duftp_send_data(dp_connp dpc, duftp_pdu *pdu, const char *data){
+    struct iovec iov[2] = {
+        { .iov_base = pdu, .iov_len = sizeof(duftp_pdu) + pdu->fname_len },
+        { .iov_base = (void *)data, .iov_len = pdu->data_size },
+    };
+    return dpsendv(dpc, iov, 2);
+}
+
+static int duftp_send_ctl(dp_connp dpc, void *buff, int msg_type, int seq_num, int error_code){
+    duftp_pdu *pdu = duftp_init_pdu(buff, msg_type, seq_num);
+    pdu->error_code = error_code;
+    return duftp_send(dpc, pdu);
+}
+
+//Puts the Merkle root in a COMPLETE.  If it could not be computed the
+//COMPLETE goes without one and the receiver takes the file on trust
+static void duftp_set_root(duftp_pdu *pdu, int have_root, uint64_t root){
+    if (have_root < 0) {
+        printf("Warning: out of memory for the content hash, sending unverified\n");
+        pdu->data_size = 0;
+        return;
     }
+    pdu->data_size = DUFTP_ROOT_SZ;
+    memcpy(duftp_data(pdu), &root, sizeof(root));
+}
 
-    sequence_number = 0;
-    
-    printf("Server waiting for file transfer...\n");
-    
-    //Loop until a disconnect is received, or error happens
-    while(1) {
-        //Receive PDU from client
-        rcvSz = dprecv(dpc, &recv_pdu, sizeof(duftp_pdu));
-        if (rcvSz == DP_CONNECTION_CLOSED){
-            if (f != NULL) {
-                fclose(f);
-            }
-            printf("Client closed connection\n");
-            return DP_CONNECTION_CLOSED;
+//Receives one message and points msg at the pieces inside buff
+static int duftp_recv(dp_connp dpc, void *buff, int buff_sz, duftp_msg *msg){
+    int rcvSz = dprecv(dpc, buff, buff_sz);
+    if (rcvSz < 0)
+        return rcvSz;
+
+    duftp_pdu *pdu = buff;
+    if (rcvSz < sizeof(duftp_pdu) || pdu->fname_len < 0 || pdu->fname_len > FNAME_SZ ||
+        pdu->data_size < 0 || pdu->data_size > DUFTP_MAX_DATA_SIZE ||
+        sizeof(duftp_pdu) + pdu->fname_len + pdu->data_size != rcvSz) {
+        printf("ERROR: Malformed du-ftp message (%d bytes)\n", rcvSz);
+        return DP_ERROR_BAD_DGRAM;
+    }
+
+    msg->pdu = pdu;
+    msg->filename = NULL;
+    if (pdu->fname_len > 0) {
+        msg->filename = (char *)(pdu + 1);
+        if (msg->filename[pdu->fname_len - 1] != '\0') {
+            printf("ERROR: Filename in du-ftp message is not terminated\n");
+            return DP_ERROR_BAD_DGRAM;
         }
-        
-        //Check sequence number
-        if (recv_pdu.seq_num != expected_seq_num) {
-            printf("Warning: Received out-of-sequence packet. Expected %d, got %d\n", 
-                   expected_seq_num, recv_pdu.seq_num);
+    }
+    msg->data = duftp_data(pdu);
+    return rcvSz;
+}
+
+/*
+ *  Checkpoint files.  They are replaced with a rename so a crash never leaves
+ *  a half written checkpoint behind.
+ */
+static int ckpt_load(const char *ckpt_path, duftp_ckpt *ckpt){
+    FILE *f = fopen(ckpt_path, "rb");
+    if (f == NULL)
+        return -1;
+    int ok = (fread(ckpt, sizeof(duftp_ckpt), 1, f) == 1);
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+static int ckpt_save(const char *ckpt_path, duftp_ckpt *ckpt){
+    char tmp_path[FNAME_SZ + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ckpt_path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL)
+        return -1;
+    int ok = (fwrite(ckpt, sizeof(duftp_ckpt), 1, f) == 1);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp_path, ckpt_path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+//Looks up a usable checkpoint for a partial file, offset is 0 if there is none
+static void ckpt_lookup(const char *file_path, const char *ckpt_path,
+                        int64_t total_size, duftp_ckpt *ckpt){
+    struct stat st;
+    if (ckpt_load(ckpt_path, ckpt) < 0 || ckpt->total_size != total_size ||
+        stat(file_path, &st) < 0 || st.st_size < ckpt->offset) {
+        ckpt->offset = 0;
+        ckpt->total_size = total_size;
+        ckpt->hash = DUHASH_INIT;
+    }
+}
+
+/*
+ *  Files being received in stripes.  The stripes of one file arrive as
+ *  separate sessions on separate pool threads, the first one creates the
+ *  file and the rest share its descriptor.  The last one out trims it to
+ *  size and closes it.
+ */
+typedef struct stripe_file {
+    struct stripe_file  *next;
+    char                path[FNAME_SZ + 16];
+    int                 fd;
+    int                 refs;
+    int64_t             total_size;
+} stripe_file;
+
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static stripe_file *stripe_files = NULL;
+
+static int stripe_acquire(const char *path, int64_t total_size){
+    stripe_file *sf;
+    int fd = -1;
+
+    pthread_mutex_lock(&stripe_lock);
+    for (sf = stripe_files; sf != NULL; sf = sf->next) {
+        if (strcmp(sf->path, path) == 0 && sf->total_size == total_size)
+            break;
+    }
+    if (sf != NULL) {
+        sf->refs++;
+        fd = sf->fd;
+    } else if ((sf = malloc(sizeof(stripe_file))) != NULL) {
+        sf->fd = duio_dst_open(path, total_size);
+        if (sf->fd < 0) {
+            free(sf);
+        } else {
+            snprintf(sf->path, sizeof(sf->path), "%s", path);
+            sf->refs = 1;
+            sf->total_size = total_size;
+            sf->next = stripe_files;
+            stripe_files = sf;
+            fd = sf->fd;
         }
-        expected_seq_num = recv_pdu.seq_num + 1;
-        
-        //Process based on message type
-        switch (recv_pdu.msg_type) {
-            case DUFTP_MSG_FILENAME:
-                printf("Receiving file: %s (size: %d bytes)\n", 
-                       recv_pdu.filename, recv_pdu.total_size);
-                snprintf(output_filename, sizeof(output_filename), "./infile/%s", recv_pdu.filename);
-                f = fopen(output_filename, "wb+");
-                if (f == NULL) {
-                    printf("ERROR: Cannot open file %s for writing\n", output_filename);
-                    memset(&send_pdu, 0, sizeof(send_pdu));
-                    send_pdu.msg_type = DUFTP_MSG_ERROR;
-                    send_pdu.protocol_ver = DUFTP_PROTOCOL_VER;
-                    send_pdu.seq_num = sequence_number++;
-                    send_pdu.error_code = DUFTP_ERR_FILE_NOT_FOUND;  
-                    dpsend(dpc, &send_pdu, sizeof(duftp_pdu));
-                    return -1;
-                }
-                
-                //Send acknowledgment
-                memset(&send_pdu, 0, sizeof(send_pdu));
-                send_pdu.msg_type = DUFTP_MSG_ACK;
-                send_pdu.protocol_ver = DUFTP_PROTOCOL_VER;
-                send_pdu.seq_num = sequence_number++;
-                
-                dpsend(dpc, &send_pdu, sizeof(duftp_pdu));
-                break;
-                
-            case DUFTP_MSG_DATA:
-                if (f == NULL) {
-                    printf("ERROR: Received data without filename\n");
-                    memset(&send_pdu, 0, sizeof(send_pdu));
-                    send_pdu.msg_type = DUFTP_MSG_ERROR;
-                    send_pdu.protocol_ver = DUFTP_PROTOCOL_VER;
-                    send_pdu.seq_num = sequence_number++;
-                    send_pdu.error_code = DUFTP_ERR_UNKNOWN;
-                    
-                    dpsend(dpc, &send_pdu, sizeof(duftp_pdu));
-                    return -1;
-                }
-                fwrite(recv_pdu.data, 1, recv_pdu.data_size, f);
-                total_bytes_received += recv_pdu.data_size;
-                
-                printf("Received %d bytes (total: %d)\n", 
-                       recv_pdu.data_size, total_bytes_received);
-                
-                //Send acknowledgment
-                memset(&send_pdu, 0, sizeof(send_pdu));
-                send_pdu.msg_type = DUFTP_MSG_ACK;
-                send_pdu.protocol_ver = DUFTP_PROTOCOL_VER;
-                send_pdu.seq_num = sequence_number++;
-                
-                dpsend(dpc, &send_pdu, sizeof(duftp_pdu));
-                break;
-                
-            case DUFTP_MSG_COMPLETE:
-                //File transfer complete
-                printf("File transfer complete: %d bytes received\n", total_bytes_received);
-                
-                if (f != NULL) {
-                    fclose(f);
-                    f = NULL;
-                }
-                memset(&send_pdu, 0, sizeof(send_pdu));
-                send_pdu.msg_type = DUFTP_MSG_ACK;
-                send_pdu.protocol_ver = DUFTP_PROTOCOL_VER;
-                send_pdu.seq_num = sequence_number++;
-                
-                dpsend(dpc, &send_pdu, sizeof(duftp_pdu));
-                printf("Waiting for client to disconnect...\n");
-                return 0;
-                
-            case DUFTP_MSG_ERROR:
-                printf("Error from client: %d\n", recv_pdu.error_code);
-                
-                if (f != NULL) {
-                    fclose(f);
-                    f = NULL;
-                }
-                break;
-                
-            default:
-                printf("Unknown message type: %d\n", recv_pdu.msg_type);
-                break;
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return fd;
+}
+
+static void stripe_release(int fd){
+    pthread_mutex_lock(&stripe_lock);
+    for (stripe_file **pp = &stripe_files; *pp != NULL; pp = &(*pp)->next) {
+        stripe_file *sf = *pp;
+        if (sf->fd != fd)
+            continue;
+        if (--sf->refs == 0) {
+            *pp = sf->next;
+            duio_dst_close(sf->fd, sf->total_size);
+            free(sf);
         }
+        break;
     }
+    pthread_mutex_unlock(&stripe_lock);
 }
 
-void start_client(dp_connp dpc){
-    duftp_pdu send_pdu;
-    duftp_pdu recv_pdu;
-    struct stat file_stat;
-    int bytes_read = 0;
-    int total_bytes_sent = 0;
-    FILE *f;
-    int rcvSz;
+/*
+ *  Receive side of a transfer, shared by the server for uploads and by the
+ *  client for downloads.  rx_open() starts a file (at resume_offset if the
+ *  sender is continuing from a checkpoint), rx_data() lands one DATA block
+ *  and rx_close() finishes it.
+ */
+static int rx_open(duftp_rx *rx, const char *path, int64_t total_size, int64_t resume_offset){
+    strncpy(rx->path, path, sizeof(rx->path) - 1);
+    rx->path[sizeof(rx->path) - 1] = '\0';
+    snprintf(rx->ckpt_path, sizeof(rx->ckpt_path), "%s%s", rx->path, DUFTP_CKPT_SUFFIX);
+    rx->total_size = total_size;
+    rx->bytes_received = 0;
 
-    if(!dpc->isConnected) {
-        printf("Client not connected\n");
-        return;
+    //The sender picks up at resume_offset, which must be the checkpoint we hold
+    ckpt_lookup(rx->path, rx->ckpt_path, total_size, &rx->ckpt);
+    if (resume_offset > 0 && resume_offset == rx->ckpt.offset) {
+        rx->fd = duio_dst_resume(rx->path, total_size);
+    } else {
+        rx->ckpt.offset = 0;
+        rx->ckpt.hash = DUHASH_INIT;
+        rx->fd = duio_dst_open(rx->path, total_size);
+    }
+    rx->end_of_data = rx->ckpt.offset;
+    rx->striped = false;
+    rx->range_start = 0;
+    rx->range_end = total_size;
+    if (rx->fd < 0)
+        return -1;
+    if (dumerkle_init(&rx->merkle, total_size) < 0) {
+        close(rx->fd);
+        rx->fd = -1;
+        return -1;
     }
+    rx->writer = duio_writer_start(DUFTP_MAX_DATA_SIZE);
+    dumetrics_expect(&metrics, total_size - rx->ckpt.offset);
+    return 0;
+}
 
-    f = fopen(full_file_path, "rb");
-    if(f == NULL){
-        printf("ERROR: Cannot open file %s\n", full_file_path);
-        exit(-1);
+//Starts receiving one stripe, the range comes from the FILENAME's data
+static int rx_open_stripe(duftp_rx *rx, const char *path, int64_t total_size, duftp_msg *msg){
+    duftp_stripe stripe;
+
+    if (msg->pdu->data_size != sizeof(stripe))
+        return -1;
+    memcpy(&stripe, msg->data, sizeof(stripe));
+    if (stripe.start < 0 || stripe.end < stripe.start || stripe.end > total_size)
+        return -1;
+
+    snprintf(rx->path, sizeof(rx->path), "%s", path);
+    rx->ckpt_path[0] = '\0';
+    rx->total_size = total_size;
+    rx->bytes_received = 0;
+    rx->end_of_data = 0;
+    rx->ckpt.offset = stripe.start;
+    rx->ckpt.total_size = total_size;
+    rx->ckpt.hash = DUHASH_INIT;
+    rx->striped = true;
+    rx->range_start = stripe.start;
+    rx->range_end = stripe.end;
+    rx->fd = stripe_acquire(path, total_size);
+    if (rx->fd < 0)
+        return -1;
+    if (dumerkle_init(&rx->merkle, stripe.end - stripe.start) < 0) {
+        stripe_release(rx->fd);
+        rx->fd = -1;
+        return -1;
     }
-    stat(full_file_path, &file_stat);
-    long file_size = file_stat.st_size;
+    rx->writer = duio_writer_start(DUFTP_MAX_DATA_SIZE);
+    dumetrics_expect(&metrics, stripe.end - stripe.start);
+    printf("Receiving stripe %d/%d of %s: bytes %lld-%lld\n", stripe.index + 1, stripe.count,
+           path, (long long)stripe.start, (long long)stripe.end);
+    return 0;
+}
 
-    char *filename = strrchr(full_file_path, '/');
-    if (filename == NULL) {
-        filename = full_file_path;
-    } else {
-        filename++; 
+//A HOLE block, the range reads as zeros and stays sparse if it can
+//A block must land inside the part of the file this receiver was opened for
+static bool rx_in_range(const duftp_rx *rx, int64_t offset, int64_t len){
+    return offset >= rx->range_start && len >= 0 && len <= rx->range_end - offset;
+}
+
+static int rx_hole(duftp_rx *rx, duftp_msg *msg){
+    duftp_pdu *pdu = msg->pdu;
+    int64_t len;
+
+    if (pdu->data_size != sizeof(len))
+        return -1;
+    memcpy(&len, msg->data, sizeof(len));
+    if (len <= 0 || !rx_in_range(rx, pdu->offset, len) ||
+        duio_dst_zero(rx->fd, pdu->offset, len) < 0) {
+        printf("ERROR: Cannot zero %lld bytes at offset %lld\n", (long long)len, (long long)pdu->offset);
+        return -1;
     }
-    
-    sequence_number = 0;
+    //Zeros are not hashed into the checkpoint, a resume restarts at the run
+    rx->bytes_received += len;
+    dumetrics_add(&metrics, len);
+    if (pdu->offset + len > rx->end_of_data)
+        rx->end_of_data = pdu->offset + len;
+    dumerkle_zero(&rx->merkle, pdu->offset - rx->range_start, len);
+    return 0;
+}
 
-    memset(&send_pdu, 0, sizeof(send_pdu));
-    send_pdu.msg_type = DUFTP_MSG_FILENAME;
-    send_pdu.protocol_ver = DUFTP_PROTOCOL_VER;
-    send_pdu.seq_num = sequence_number++;
-    send_pdu.data_size = 0;
-    send_pdu.total_size = file_size;
-    strncpy(send_pdu.filename, filename, FNAME_SZ - 1);
-    
-    printf("Sending file: %s (size: %ld bytes)\n", filename, file_size);
-    
-    dpsend(dpc, &send_pdu, sizeof(duftp_pdu));
+static int rx_data(duftp_rx *rx, duftp_msg *msg){
+    duftp_pdu *pdu = msg->pdu;
+    const char *data = msg->data;
+    int len = pdu->data_size;
 
-    rcvSz = dprecv(dpc, &recv_pdu, sizeof(duftp_pdu));
-    if (rcvSz == DP_CONNECTION_CLOSED) {
-        printf("Server closed connection\n");
-        fclose(f);
+    if (pdu->flags & DUFTP_FLAG_HOLE)
+        return rx_hole(rx, msg);
+
+    if (pdu->flags & DUFTP_FLAG_LZ) {
+        len = dulz_decompress(msg->data, pdu->data_size, rx->zbuf, sizeof(rx->zbuf));
+        if (len < 0) {
+            printf("ERROR: Corrupt compressed block at offset %lld\n", (long long)pdu->offset);
+            return -1;
+        }
+        data = rx->zbuf;
+    }
+
+    //Every block says where it goes, arrival order does not matter.  The
+    //write goes to the background writer so the next datagram is not held up
+    int rc = -1;
+    if (rx_in_range(rx, pdu->offset, len))
+        rc = (rx->writer != NULL) ?
+                duio_writer_submit(rx->writer, rx->fd, data, len, pdu->offset) :
+                duio_dst_write(rx->fd, data, len, pdu->offset);
+    if (rc < 0) {
+        printf("ERROR: Cannot write block at offset %lld\n", (long long)pdu->offset);
+        return -1;
+    }
+    rx->bytes_received += len;
+    dumetrics_add(&metrics, len);
+    if (pdu->offset + len > rx->end_of_data)
+        rx->end_of_data = pdu->offset + len;
+    if (pdu->offset == rx->ckpt.offset) {
+        rx->ckpt.hash = duhash_update(rx->ckpt.hash, data, len);
+        rx->ckpt.offset += len;
+    }
+    dumerkle_leaf(&rx->merkle, pdu->offset - rx->range_start, data, len);
+    return 0;
+}
+
+//Makes the in order prefix durable and records it, called at checkpoint blocks
+static void rx_checkpoint(duftp_rx *rx){
+    //A stripe only covers part of the file, there is no prefix to record
+    if (rx->striped)
+        return;
+    if (rx->writer != NULL && duio_writer_drain(rx->writer) < 0)
         return;
+    fdatasync(rx->fd);
+    if (ckpt_save(rx->ckpt_path, &rx->ckpt) < 0)
+        printf("Warning: could not save checkpoint %s\n", rx->ckpt_path);
+}
+
+/*
+ *  Checks the file against the root the sender put in its COMPLETE.  Leaves
+ *  no block supplied (a resumed prefix, odd sized blocks) are read back from
+ *  the file.  A COMPLETE without a root is taken on trust.
+ */
+static int rx_verify(duftp_rx *rx, duftp_msg *msg){
+    uint64_t want, got;
+
+    if (rx->writer != NULL && duio_writer_drain(rx->writer) < 0) {
+        printf("ERROR: Writing %s failed\n", rx->path);
+        return -1;
     }
-    
-    if (recv_pdu.msg_type == DUFTP_MSG_ERROR) {
-        printf("Error from server: %d\n", recv_pdu.error_code);
-        fclose(f);
+    if (msg->pdu->data_size != DUFTP_ROOT_SZ)
+        return 0;
+    memcpy(&want, msg->data, sizeof(want));
+    if ((!rx->striped && rx->end_of_data != rx->total_size) ||
+        dumerkle_fill_fd(&rx->merkle, rx->fd, rx->range_start) < 0 ||
+        dumerkle_root(&rx->merkle, &got) < 0 || got != want) {
+        printf("ERROR: %s does not match the sender's content hash\n", rx->path);
+        return -1;
+    }
+    printf("Content hash verified\n");
+    return 0;
+}
+
+static void rx_close(duftp_rx *rx, bool complete){
+    duio_writer_stop(rx->writer);
+    rx->writer = NULL;
+    dumerkle_free(&rx->merkle);
+    if (rx->fd < 0)
+        return;
+    if (rx->striped) {
+        stripe_release(rx->fd);
+        rx->fd = -1;
         return;
     }
+    duio_dst_close(rx->fd, rx->end_of_data);
+    rx->fd = -1;
+    if (complete)
+        unlink(rx->ckpt_path);
+}
+
+//Throws away a file that failed verification, checkpoint and all
+static void rx_discard(duftp_rx *rx){
+    rx_close(rx, true);
+    unlink(rx->path);
+}
+
+//Waits for the peer's answer to a checkpoint, FILENAME or COMPLETE,
+//the sender can do nothing else meanwhile, so the time counts as a stall
+static int wait_ack(dp_connp dpc, void *rBuff, int rbuff_sz, duftp_msg *ack){
+    duftp_msg msg;
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rcvSz = duftp_recv(dpc, rBuff, rbuff_sz, &msg);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    dumetrics_stall(&metrics, (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec));
+    if (rcvSz == DP_CONNECTION_CLOSED) {
+        printf("Peer closed connection\n");
+        return -1;
+    }
+    if (rcvSz < 0)
+        return -1;
     
-    if (recv_pdu.msg_type != DUFTP_MSG_ACK) {
-        printf("Unexpected response from server: %d\n", recv_pdu.msg_type);
-        fclose(f);
-        return;
+    if (msg.pdu->msg_type == DUFTP_MSG_ERROR) {
+        printf("Error from peer: %d\n", msg.pdu->error_code);
+        return -1;
     }
     
-    while ((bytes_read = fread(send_pdu.data, 1, DUFTP_MAX_DATA_SIZE, f)) > 0) {
-        send_pdu.msg_type = DUFTP_MSG_DATA;
-        send_pdu.protocol_ver = DUFTP_PROTOCOL_VER;
-        send_pdu.seq_num = sequence_number++;
-        send_pdu.data_size = bytes_read;
-        
-        dpsend(dpc, &send_pdu, sizeof(duftp_pdu));
-        total_bytes_sent += bytes_read;
-        
-        printf("Sent %d bytes (total: %d/%ld)\n", bytes_read, total_bytes_sent, file_size);
+    if (msg.pdu->msg_type != DUFTP_MSG_ACK) {
+        printf("Unexpected response from peer: %d\n", msg.pdu->msg_type);
+        return -1;
+    }
+    if (ack != NULL)
+        *ack = msg;
+    return 0;
+}
 
-        rcvSz = dprecv(dpc, &recv_pdu, sizeof(duftp_pdu));
-        if (rcvSz == DP_CONNECTION_CLOSED) {
-            printf("Server closed connection\n");
-            fclose(f);
-            return;
-        }
-        
-        if (recv_pdu.msg_type != DUFTP_MSG_ACK) {
-            printf("Unexpected response from server: %d\n", recv_pdu.msg_type);
-            fclose(f);
-            return;
+/*
+ *  The compressor thread.  It runs up to DUFTP_ZPIPE_DEPTH blocks ahead of
+ *  the sender.  Blocks that do not shrink go out raw, and after a run of them
+ *  (already compressed media, archives) only every DUFTP_ZPIPE_PROBE th block
+ *  is tried so incompressible data costs next to nothing.
+ */
+#define DUFTP_ZPIPE_GIVEUP   8
+#define DUFTP_ZPIPE_PROBE    16
+
+static void *zpipe_worker(void *arg){
+    duftp_zpipe *zp = arg;
+    int misses = 0, skip = 0;
+
+    for (int64_t offset = zp->start; offset < zp->size; offset += DUFTP_MAX_DATA_SIZE) {
+        pthread_mutex_lock(&zp->lock);
+        while (zp->count == DUFTP_ZPIPE_DEPTH && !zp->stop)
+            pthread_cond_wait(&zp->cond, &zp->lock);
+        if (zp->stop) {
+            pthread_mutex_unlock(&zp->lock);
+            break;
         }
+        duftp_zslot *slot = &zp->slots[(zp->head + zp->count) % DUFTP_ZPIPE_DEPTH];
+        pthread_mutex_unlock(&zp->lock);
+
+        //The slot is not published yet, it is ours to fill without the lock
+        int64_t left = zp->size - offset;
+        slot->offset = offset;
+        slot->raw_len = (left > DUFTP_MAX_DATA_SIZE) ? DUFTP_MAX_DATA_SIZE : left;
+        slot->len = -1;
+        if (skip > 0)
+            skip--;
+        else if (!duio_zero(zp->base + offset, slot->raw_len))
+            slot->len = dulz_compress(zp->base + offset, slot->raw_len, slot->data, sizeof(slot->data));
+        slot->compressed = (slot->len > 0);
+        if (!slot->compressed)
+            slot->len = slot->raw_len;
+        if (slot->compressed)
+            misses = 0;
+        else if (++misses >= DUFTP_ZPIPE_GIVEUP)
+            skip = DUFTP_ZPIPE_PROBE - 1;
+
+        pthread_mutex_lock(&zp->lock);
+        zp->count++;
+        pthread_cond_broadcast(&zp->cond);
+        pthread_mutex_unlock(&zp->lock);
     }
-    
-    memset(&send_pdu, 0, sizeof(send_pdu));
-    send_pdu.msg_type = DUFTP_MSG_COMPLETE;
-    send_pdu.protocol_ver = DUFTP_PROTOCOL_VER;
-    send_pdu.seq_num = sequence_number++;
-    send_pdu.data_size = 0;
-    
-    dpsend(dpc, &send_pdu, sizeof(duftp_pdu));
-    
-    rcvSz = dprecv(dpc, &recv_pdu, sizeof(duftp_pdu));
-    if (rcvSz == DP_CONNECTION_CLOSED) {
-        printf("Server closed connection\n");
-        fclose(f);
-        return;
+    return NULL;
+}
+
+static duftp_zpipe *zpipe_start(const char *base, int64_t start, int64_t size){
+    duftp_zpipe *zp = malloc(sizeof(duftp_zpipe));
+    if (zp == NULL)
+        return NULL;
+    pthread_mutex_init(&zp->lock, NULL);
+    pthread_cond_init(&zp->cond, NULL);
+    zp->base = base;
+    zp->start = start;
+    zp->size = size;
+    zp->head = 0;
+    zp->count = 0;
+    zp->stop = false;
+    if (pthread_create(&zp->tid, NULL, zpipe_worker, zp) != 0) {
+        free(zp);
+        return NULL;
     }
-    
-    if (recv_pdu.msg_type != DUFTP_MSG_ACK) {
-        printf("Unexpected response from server: %d\n", recv_pdu.msg_type);
-        fclose(f);
+    return zp;
+}
+
+//The next block in order, it stays valid until zpipe_release()
+static duftp_zslot *zpipe_next(duftp_zpipe *zp){
+    pthread_mutex_lock(&zp->lock);
+    while (zp->count == 0)
+        pthread_cond_wait(&zp->cond, &zp->lock);
+    duftp_zslot *slot = &zp->slots[zp->head];
+    pthread_mutex_unlock(&zp->lock);
+    return slot;
+}
+
+static void zpipe_release(duftp_zpipe *zp){
+    pthread_mutex_lock(&zp->lock);
+    zp->head = (zp->head + 1) % DUFTP_ZPIPE_DEPTH;
+    zp->count--;
+    pthread_cond_broadcast(&zp->cond);
+    pthread_mutex_unlock(&zp->lock);
+}
+
+static void zpipe_stop(duftp_zpipe *zp){
+    if (zp == NULL)
         return;
+    pthread_mutex_lock(&zp->lock);
+    zp->stop = true;
+    pthread_cond_broadcast(&zp->cond);
+    pthread_mutex_unlock(&zp->lock);
+    pthread_join(zp->tid, NULL);
+    pthread_mutex_destroy(&zp->lock);
+    pthread_cond_destroy(&zp->cond);
+    free(zp);
+}
+
+/*
+ *  Send side of a transfer, shared by client uploads and server downloads.
+ *  Streams [start, end) of base as DATA blocks straight from the mapping,
+ *  stopping only for checkpoint ACKs, then sends COMPLETE and waits for its
+ *  ACK.  With compress the blocks come from the compressor thread instead,
+ *  raw ones still straight from the mapping.  The content hash of the range
+ *  [first, end) this session covers (the whole file unless striping) is
+ *  worked out on other threads meanwhile and goes out with the COMPLETE.
+ *  Runs of zeros (holes and all zero blocks) go out as a single HOLE block
+ *  that only carries their length.  Returns the number of bytes sent
+ *  (before compression and zero elision) or -1.
+ */
+static int64_t send_blocks(dp_connp dpc, void *sBuff, void *rBuff, int rbuff_sz,
+                           const duio_src *src, int64_t first, int64_t end, int64_t start,
+                           int *seq, bool compress){
+    const char *base = src->base;
+    int64_t total_bytes_sent = 0;
+    int64_t data_bytes = 0;         //sent as blocks, holes are not compressed
+    int64_t wire_bytes = 0;         //what those blocks took on the wire
+    int64_t zero_bytes = 0;
+    int64_t hole = -1;
+    int64_t prefetched = start;
+    int blocks_sent = 0;
+    duftp_zpipe *zp = NULL;
+    dumerkle merkle;
+
+    if (dumerkle_init(&merkle, end - first) < 0)
+        return -1;
+    dumerkle_start(&merkle, base + first, sysconf(_SC_NPROCESSORS_ONLN));
+    if (compress && start < end)
+        zp = zpipe_start(base, start, end);
+
+    duftp_pdu *send_pdu = duftp_init_pdu(sBuff, DUFTP_MSG_DATA, 0);
+    for (int64_t offset = start; offset < end; ) {
+        int64_t left = end - offset;
+        int raw_len = (left > DUFTP_MAX_DATA_SIZE) ? DUFTP_MAX_DATA_SIZE : left;
+        const char *data = base + offset;
+        send_pdu->seq_num = (*seq)++;
+        send_pdu->offset = offset;
+        send_pdu->data_size = raw_len;
+        send_pdu->flags = (++blocks_sent % DUFTP_CKPT_INTERVAL == 0) ?
+                            DUFTP_FLAG_CKPT : DUFTP_FLAG_NONE;
+
+        //Keep the next DUFTP_PREFETCH bytes on their way in from disk
+        if (prefetched < offset)
+            prefetched = offset;
+        if (offset + DUFTP_PREFETCH / 2 >= prefetched && prefetched < end) {
+            duio_src_prefetch(src, prefetched, DUFTP_PREFETCH);
+            prefetched += DUFTP_PREFETCH;
+        }
+
+        int64_t zeros = duio_src_zeros(src, offset, end, DUFTP_MAX_DATA_SIZE, &hole);
+        if (zeros > offset) {
+            int64_t run = zeros - offset;
+            send_pdu->flags |= DUFTP_FLAG_HOLE;
+            send_pdu->data_size = sizeof(run);
+            //The compressor works through the run too, its blocks are not needed
+            for (int64_t skip = offset; zp != NULL && skip < zeros; skip += DUFTP_MAX_DATA_SIZE) {
+                zpipe_next(zp);
+                zpipe_release(zp);
+            }
+            if (duftp_send_data(dpc, send_pdu, (const char *)&run) < 0)
+                goto fail;
+            offset = zeros;
+            total_bytes_sent += run;
+            dumetrics_add(&metrics, run);
+            zero_bytes += run;
+            if ((send_pdu->flags & DUFTP_FLAG_CKPT) && wait_ack(dpc, rBuff, rbuff_sz, NULL) < 0)
+                goto fail;
+            continue;
+        }
+
+        duftp_zslot *slot = (zp != NULL) ? zpipe_next(zp) : NULL;
+        if (slot != NULL && slot->compressed) {
+            data = slot->data;
+            send_pdu->data_size = slot->len;
+            send_pdu->flags |= DUFTP_FLAG_LZ;
+        }
+        int rc = duftp_send_data(dpc, send_pdu, data);
+        if (slot != NULL)
+            zpipe_release(zp);
+        if (rc < 0)
+            goto fail;
+        offset += raw_len;
+        total_bytes_sent += raw_len;
+        dumetrics_add(&metrics, raw_len);
+        data_bytes += raw_len;
+        wire_bytes += send_pdu->data_size;
+
+        //Keep streaming, only stop to collect the ACK for a checkpoint block
+        if (!(send_pdu->flags & DUFTP_FLAG_CKPT))
+            continue;
+        if (wait_ack(dpc, rBuff, rbuff_sz, NULL) < 0)
+            goto fail;
     }
+    zpipe_stop(zp);
+    zp = NULL;
+    if (zero_bytes > 0)
+        printf("Skipped %lld bytes of zeros\n", (long long)zero_bytes);
+    if (compress && data_bytes > 0)
+        printf("Compressed %lld bytes to %lld on the wire (%.2fx)\n", (long long)data_bytes,
+               (long long)wire_bytes, (double)data_bytes / wire_bytes);
     
-    printf("File transfer complete: %d bytes sent\n", total_bytes_sent);
-    
-    fclose(f);
-    
-    printf("Disconnecting from server...\n");
-    dpdisconnect(dpc);
+    uint64_t root;
+    int have_root = dumerkle_root(&merkle, &root);
+    dumerkle_free(&merkle);
+    send_pdu = duftp_init_pdu(sBuff, DUFTP_MSG_COMPLETE, (*seq)++);
+    duftp_set_root(send_pdu, have_root, root);
+    duftp_send(dpc, send_pdu);
+    if (wait_ack(dpc, rBuff, rbuff_sz, NULL) < 0)
+        return -1;
+    return total_bytes_sent;
+
+fail:
+    zpipe_stop(zp);
+    dumerkle_free(&merkle);
+    return -1;
 }
 
-void start_server(dp_connp dpc){
-    printf("Server started. Waiting for connections...\n");
-    server_loop(dpc, sbuffer, rbuffer, sizeof(sbuffer), sizeof(rbuffer));
+/*
+ *  A name a client sends must name something below ./infile, the same rule
+ *  a directory manifest is held to, and not the chunk store kept there.
+ *  dutree_safe_path() allows no "." or empty components, so the store can
+ *  only be reached through a first component of exactly ".store"
+ */
+static bool server_name_ok(const char *filename){
+    if (filename == NULL || !dutree_safe_path(filename))
+        return false;
+    return !(strncmp(filename, ".store", 6) == 0 &&
+             (filename[6] == '\0' || filename[6] == '/'));
 }
 
+/*
+ *  Serves a GET.  Hot files are shared between sessions through the du-io
+ *  mapping cache, so many concurrent downloads of one file read the same
+ *  page cache pages.
+ */
+static void server_send_file(dp_connp dpc, void *sBuff, void *rBuff, int rbuff_sz,
+                             const char *filename, int *seq, bool compress){
+    char path[FNAME_SZ + 16];
+    if (!server_name_ok(filename)) {
+        printf("ERROR: Refusing to send %s\n", filename);
+        duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, (*seq)++, DUFTP_ERR_PERMISSION);
+        return;
+    }
+    snprintf(path, sizeof(path), "./infile/%s", filename);
+
+    duio_src *src = duio_cache_get(path);
+    if (src == NULL) {
+        printf("ERROR: Requested file %s not found\n", path);
+        duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, (*seq)++, DUFTP_ERR_FILE_NOT_FOUND);
+        return;
+    }
 
-int main(int argc, char *argv[])
-{
-    prog_config cfg;
-    int cmd;
-    dp_connp dpc;
-    int rc;
+    printf("Sending file: %s (size: %lld bytes)\n", filename, (long long)src->size);
+    duftp_pdu *send_pdu = duftp_init_pdu(sBuff, DUFTP_MSG_FILENAME, (*seq)++);
+    send_pdu->total_size = src->size;
+    send_pdu->flags = compress ? DUFTP_FLAG_LZ : DUFTP_FLAG_NONE;
+    duftp_set_filename(send_pdu, filename);
+    duftp_send(dpc, send_pdu);
 
-    // Process the parameters and init the header
-    cmd = initParams(argc, argv, &cfg);
+    if (wait_ack(dpc, rBuff, rbuff_sz, NULL) == 0) {
+        int64_t sent = send_blocks(dpc, sBuff, rBuff, rbuff_sz, src, 0, src->size, 0,
+                                    seq, compress);
+        if (sent >= 0)
+            printf("File transfer complete: %lld bytes sent\n", (long long)sent);
+    }
+    duio_cache_put(src);
+}
 
-    printf("MODE %d\n", cfg.prog_mode);
-    printf("PORT %d\n", cfg.port_number);
-    printf("FILE NAME: %s\n", cfg.file_name);
+//The hash that confirms a weak checksum hit on a delta block
+static void delta_strong(const char *block, uint64_t strong[2]){
+    strong[0] = duhash_block(block, DUFTP_DELTA_BLOCK, DUFTP_SIG_SEED1);
+    strong[1] = duhash_block(block, DUFTP_DELTA_BLOCK, DUFTP_SIG_SEED2);
+}
 
-    switch(cmd){
-        case PROG_MD_CLI:
-            // For client, we still need the file path to read from
-            snprintf(full_file_path, sizeof(full_file_path), "./outfile/%s", cfg.file_name);
-            dpc = dpClientInit(cfg.svr_ip_addr, cfg.port_number);
-            rc = dpconnect(dpc);
-            if (rc < 0) {
-                perror("Error establishing connection");
-                exit(-1);
-            }
+//Applies the ops in one DELTA PDU to the new file, -1 if they are malformed
+static int delta_apply(int fd, duio_src *old, duftp_msg *msg, int64_t *out){
+    const char *pos = msg->data;
+    const char *end = msg->data + msg->pdu->data_size;
 
-            start_client(dpc);
-            exit(0);
-            break;
+    while (pos < end) {
+        duftp_delta_op op;
+        const char *src;
+        if (end - pos < (int)sizeof(op))
+            return -1;
+        memcpy(&op, pos, sizeof(op));
+        pos += sizeof(op);
+        if (op.len < 0)
+            return -1;
 
-        case PROG_MD_SVR:
-            dpc = dpServerInit(cfg.port_number);
+        if (op.type == DUFTP_OP_COPY) {
+            if (op.src_offset < 0 || op.src_offset + op.len > old->size)
+                return -1;
+            src = old->base + op.src_offset;
+        } else if (op.type == DUFTP_OP_LITERAL) {
+            if (op.len > end - pos)
+                return -1;
+            src = pos;
+            pos += op.len;
+        } else {
+            return -1;
+        }
+        if (duio_dst_write(fd, src, op.len, *out) < 0)
+            return -1;
+        *out += op.len;
+    }
+    return 0;
+}
+
+/*
+ *  Serves a delta upload.  Signatures of our copy go out first, then the
+ *  client's ops rebuild its version in a temporary file next to ours, which
+ *  replaces ours only once its Merkle root, read back from the file, matches
+ *  the client's.  Without a copy
+ *  there are no signatures and the client just sends literals.  Returns the
+ *  dp error if the connection failed, 0 otherwise (errors with the transfer
+ *  itself have been reported to the client by then).
+ */
+static int server_delta(dp_connp dpc, void *sBuff, void *rBuff, int rbuff_sz,
+                        duftp_msg *req, int *seq){
+    char path[FNAME_SZ + 16];
+    char tmp_path[FNAME_SZ + 32];
+    duio_src old = { .fd = -1 };
+    duftp_msg msg;
+    int64_t total_size = req->pdu->total_size;
+    int64_t out = 0;
+    int rc = 0;
+
+    if (!server_name_ok(req->filename)) {
+        printf("ERROR: Refusing delta for %s\n", req->filename);
+        duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, (*seq)++, DUFTP_ERR_PERMISSION);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "./infile/%s", req->filename);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.delta", path);
+    bool have_old = (duio_src_open(&old, path) == 0);
+
+    int64_t nsigs = have_old ? old.size / DUFTP_DELTA_BLOCK : 0;
+    int per_pdu = DUFTP_MAX_DATA_SIZE / sizeof(duftp_sig);
+    int64_t i = 0;
+    printf("Delta for file: %s, %lld signatures\n", req->filename, (long long)nsigs);
+    do {
+        duftp_pdu *pdu = duftp_init_pdu(sBuff, DUFTP_MSG_SIGS, (*seq)++);
+        duftp_sig *sig = (duftp_sig *)duftp_data(pdu);
+        int n;
+        for (n = 0; n < per_pdu && i < nsigs; n++, i++) {
+            const char *block = old.base + i * DUFTP_DELTA_BLOCK;
+            sig[n].weak = duhash_weak(block, DUFTP_DELTA_BLOCK);
+            sig[n].pad = 0;
+            delta_strong(block, sig[n].strong);
+        }
+        pdu->data_size = n * sizeof(duftp_sig);
+        pdu->offset = i - n;
+        pdu->total_size = nsigs;
+        pdu->flags = (i == nsigs) ? DUFTP_FLAG_LAST : DUFTP_FLAG_NONE;
+        duftp_send(dpc, pdu);
+    } while (i < nsigs);
+
+    int fd = duio_dst_open(tmp_path, total_size);
+    if (fd < 0) {
+        printf("ERROR: Cannot open file %s for writing\n", tmp_path);
+        duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, (*seq)++, DUFTP_ERR_PERMISSION);
+        goto done;
+    }
+
+    while (1) {
+        int rcvSz = duftp_recv(dpc, rBuff, rbuff_sz, &msg);
+        if (rcvSz == DP_ERROR_BAD_DGRAM)
+            continue;
+        if (rcvSz < 0) {
+            rc = rcvSz;
+            break;
+        }
+        if (msg.pdu->msg_type == DUFTP_MSG_DELTA) {
+            if (delta_apply(fd, &old, &msg, &out) < 0 || out > total_size) {
+                printf("ERROR: Bad delta for %s\n", req->filename);
+                duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, (*seq)++, DUFTP_ERR_UNKNOWN);
+                break;
+            }
+            if (msg.pdu->flags & DUFTP_FLAG_CKPT)
+                duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ACK, (*seq)++, DUFTP_ERR_NONE);
+            continue;
+        }
+        if (msg.pdu->msg_type == DUFTP_MSG_COMPLETE) {
+            uint64_t want, got;
+            dumerkle merkle;
+            bool ok = out == total_size && msg.pdu->data_size == DUFTP_ROOT_SZ &&
+                      dumerkle_init(&merkle, out) == 0;
+            if (ok) {
+                memcpy(&want, msg.data, sizeof(want));
+                ok = dumerkle_fill_fd(&merkle, fd, 0) == 0 &&
+                     dumerkle_root(&merkle, &got) == 0 && got == want;
+                dumerkle_free(&merkle);
+            }
+            if (!ok) {
+                printf("ERROR: Delta result for %s does not match the client's file\n", req->filename);
+                duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, (*seq)++, DUFTP_ERR_CHECKSUM);
+                break;
+            }
+            duio_dst_close(fd, out);
+            fd = -1;
+            if (rename(tmp_path, path) < 0) {
+                duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, (*seq)++, DUFTP_ERR_PERMISSION);
+                break;
+            }
+            printf("Delta transfer complete: %lld bytes rebuilt\n", (long long)out);
+            duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ACK, (*seq)++, DUFTP_ERR_NONE);
+            break;
+        }
+        if (msg.pdu->msg_type == DUFTP_MSG_ERROR)
+            printf("Error from client: %d\n", msg.pdu->error_code);
+        else
+            printf("Unexpected message during delta: %d\n", msg.pdu->msg_type);
+        break;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp_path);
+    }
+done:
+    if (have_old)
+        duio_src_close(&old);
+    return rc;
+}
+
+/*
+ *  Directory transfers, receive side.  The manifest arrives first, in as many
+ *  MANIFEST PDUs as it takes, and the last one asks for an ACK.  DATA blocks
+ *  then carry the concatenation of all the files, a block is cut at file
+ *  boundaries and each piece written to its own file.
+ */
+static void tree_rx_close_file(duftp_tree_rx *trx){
+    if (trx->cur < 0)
+        return;
+    duio_dst_close(trx->fd, trx->tree.ents[trx->cur].size);
+    trx->cur = -1;
+    trx->fd = -1;
+}
+
+static void tree_rx_reset(duftp_tree_rx *trx){
+    tree_rx_close_file(trx);
+    dutree_free(&trx->tree);
+    trx->bytes_received = 0;
+    trx->active = false;
+}
+
+static int tree_rx_open_file(duftp_tree_rx *trx, int idx){
+    char path[PATH_MAX];
+    dutree_ent *ent = &trx->tree.ents[idx];
+
+    tree_rx_close_file(trx);
+    snprintf(path, sizeof(path), "%s/%s", trx->root, ent->path);
+    if (dutree_mkdirs(path) < 0 || (trx->fd = duio_dst_open(path, ent->size)) < 0) {
+        printf("ERROR: Cannot open file %s for writing\n", path);
+        return -1;
+    }
+    trx->cur = idx;
+    return 0;
+}
+
+static int tree_rx_manifest(duftp_tree_rx *trx, duftp_msg *msg){
+    int first = trx->tree.count;
+
+    if (trx->tree.count == 0) {
+        if (msg->filename == NULL || !dutree_safe_path(msg->filename))
+            return -1;
+        snprintf(trx->root, sizeof(trx->root), "./infile/%s", msg->filename);
+    }
+    if (dutree_decode(&trx->tree, msg->data, msg->pdu->data_size) < 0)
+        return -1;
+    for (int i = first; i < trx->tree.count; i++) {
+        if (!dutree_safe_path(trx->tree.ents[i].path)) {
+            printf("ERROR: Refusing manifest path %s\n", trx->tree.ents[i].path);
+            return -1;
+        }
+    }
+    if (!(msg->pdu->flags & DUFTP_FLAG_CKPT))
+        return 0;
+
+    //Manifest complete.  Empty files never see a DATA block, make them now
+    for (int i = 0; i < trx->tree.count; i++) {
+        if (trx->tree.ents[i].size == 0 && tree_rx_open_file(trx, i) < 0)
+            return -1;
+    }
+    tree_rx_close_file(trx);
+    trx->active = true;
+    dumetrics_expect(&metrics, trx->tree.total_size);
+    printf("Receiving directory: %s (%d files, %lld bytes)\n", msg->filename,
+           trx->tree.count, (long long)trx->tree.total_size);
+    return 0;
+}
+
+static int tree_rx_data(duftp_tree_rx *trx, duftp_msg *msg){
+    int64_t offset = msg->pdu->offset;
+    const char *data = msg->data;
+    int left = msg->pdu->data_size;
+
+    while (left > 0) {
+        int idx = dutree_find(&trx->tree, offset);
+        if (idx < 0) {
+            printf("ERROR: Block at offset %lld is outside the manifest\n", (long long)offset);
+            return -1;
+        }
+        if (idx != trx->cur && tree_rx_open_file(trx, idx) < 0)
+            return -1;
+
+        dutree_ent *ent = &trx->tree.ents[idx];
+        int64_t file_left = ent->start + ent->size - offset;
+        int n = (left < file_left) ? left : file_left;
+        if (duio_dst_write(trx->fd, data, n, offset - ent->start) < 0) {
+            printf("ERROR: Cannot write %s\n", ent->path);
+            return -1;
+        }
+        if (n == file_left)
+            tree_rx_close_file(trx);
+        offset += n;
+        data += n;
+        left -= n;
+    }
+    trx->bytes_received += msg->pdu->data_size;
+    dumetrics_add(&metrics, msg->pdu->data_size);
+    return 0;
+}
+
+/*
+ *  Deduplicated uploads, receive side.  CHUNKS PDUs build up the chunk list,
+ *  once the last one is in the file is started and every chunk the store
+ *  holds is copied into it.  The HAVE bitmap tells the client which chunks
+ *  that covered, DATA for the rest then arrives like any upload and at the
+ *  COMPLETE the verified file goes into the store.
+ */
+static void dedup_rx_reset(duftp_dedup_rx *drx){
+    free(drx->chunks);
+    drx->chunks = NULL;
+    drx->count = 0;
+    drx->capacity = 0;
+    drx->listed = 0;
+    drx->active = false;
+}
+
+static int dedup_rx_chunks(duftp_dedup_rx *drx, duftp_msg *msg){
+    duftp_pdu *pdu = msg->pdu;
+    int n = pdu->data_size / sizeof(duftp_chunk);
+
+    if (pdu->offset == 0)
+        dedup_rx_reset(drx);
+    if (pdu->offset != drx->count || pdu->data_size % sizeof(duftp_chunk) != 0)
+        return -1;
+    if (drx->count + n > drx->capacity) {
+        int capacity = (drx->capacity == 0) ? 1024 : drx->capacity;
+        while (capacity < drx->count + n)
+            capacity *= 2;
+        dustore_chunk *bigger = realloc(drx->chunks, capacity * sizeof(dustore_chunk));
+        if (bigger == NULL)
+            return -1;
+        drx->chunks = bigger;
+        drx->capacity = capacity;
+    }
+    for (int i = 0; i < n; i++) {
+        duftp_chunk c;
+        memcpy(&c, msg->data + i * sizeof(c), sizeof(c));
+        if (c.len <= 0 || c.len > DUSTORE_MAX_CHUNK)
+            return -1;
+        dustore_chunk *dc = &drx->chunks[drx->count++];
+        memcpy(dc->key.h, c.key, sizeof(dc->key.h));
+        dc->offset = drx->listed;
+        dc->len = c.len;
+        drx->listed += c.len;
+    }
+    return 0;
+}
+
+//Copies what the store has into the new file and sends the HAVE bitmap
+static int dedup_rx_fill(duftp_dedup_rx *drx, duftp_rx *rx, dp_connp dpc, void *sBuff, int *seq){
+    int64_t have_bytes = 0;
+    int have = 0;
+
+    for (int first = 0; first == 0 || first < drx->count; first += DUFTP_MAX_DATA_SIZE * 8) {
+        int n = drx->count - first;
+        if (n > DUFTP_MAX_DATA_SIZE * 8)
+            n = DUFTP_MAX_DATA_SIZE * 8;
+        duftp_pdu *pdu = duftp_init_pdu(sBuff, DUFTP_MSG_HAVE, (*seq)++);
+        unsigned char *bits = (unsigned char *)duftp_data(pdu);
+        pdu->offset = first;
+        pdu->data_size = (n + 7) / 8;
+        memset(bits, 0, pdu->data_size);
+        for (int i = 0; i < n; i++) {
+            dustore_chunk *c = &drx->chunks[first + i];
+            if (dustore_copy(&c->key, c->len, rx->fd, c->offset) < 0)
+                continue;
+            bits[i / 8] |= 1 << (i % 8);
+            if (c->offset + c->len > rx->end_of_data)
+                rx->end_of_data = c->offset + c->len;
+            have_bytes += c->len;
+            have++;
+        }
+        if (first + n >= drx->count)
+            pdu->flags = DUFTP_FLAG_LAST;
+        if (duftp_send(dpc, pdu) < 0)
+            return -1;
+    }
+    if (have_bytes > 0)
+        dumetrics_add(&metrics, have_bytes);
+    printf("Deduplicated upload: %d of %d chunks (%lld bytes) from the store\n",
+           have, drx->count, (long long)have_bytes);
+    drx->active = true;
+    return 0;
+}
+
+static int server_dispatch(dp_connp dpc, void *sBuff, void *rBuff, int rbuff_sz,
+                           duftp_tree_rx *trx, duftp_dedup_rx *drx);
+
+int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_sz){
+    duftp_tree_rx trx = { .cur = -1, .fd = -1 };
+    duftp_dedup_rx drx = { 0 };
+
+    dutree_init(&trx.tree);
+    int rc = server_dispatch(dpc, sBuff, rBuff, rbuff_sz, &trx, &drx);
+    tree_rx_reset(&trx);
+    dedup_rx_reset(&drx);
+    return rc;
+}
+
+static int server_dispatch(dp_connp dpc, void *sBuff, void *rBuff, int rbuff_sz,
+                           duftp_tree_rx *trx, duftp_dedup_rx *drx){
+    int rcvSz;
+    duftp_msg msg;
+    duftp_pdu *recv_pdu;
+    duftp_rx rx = { .fd = -1 };
+    char output_filename[FNAME_SZ + 16];
+    int expected_seq_num = 0;
+    int sequence_number;
+
+    if (dpc->isConnected == false){
+        perror("Expecting the protocol to be in connect state, but its not");
+        exit(-1);
+    }
+
+    sequence_number = 0;
+    
+    printf("Server waiting for file transfer...\n");
+    
+    //Loop until a disconnect is received, or error happens
+    while(1) {
+        //Receive PDU from client
+        rcvSz = duftp_recv(dpc, rBuff, rbuff_sz, &msg);
+        if (rcvSz == DP_CONNECTION_CLOSED){
+            rx_close(&rx, false);
+            printf("Client closed connection\n");
+            return DP_CONNECTION_CLOSED;
+        }
+        if (rcvSz == DP_ERROR_BAD_DGRAM)
+            continue;
+        if (rcvSz < 0) {
+            rx_close(&rx, false);
+            return -1;
+        }
+        recv_pdu = msg.pdu;
+        
+        //Check sequence number
+        if (recv_pdu->seq_num != expected_seq_num) {
+            printf("Warning: Received out-of-sequence packet. Expected %d, got %d\n", 
+                   expected_seq_num, recv_pdu->seq_num);
+        }
+        expected_seq_num = recv_pdu->seq_num + 1;
+        
+        //Process based on message type
+        switch (recv_pdu->msg_type) {
+            case DUFTP_MSG_REQUEST:
+            case DUFTP_MSG_DELTA_REQ:
+            case DUFTP_MSG_RESUME:
+            case DUFTP_MSG_FILENAME:
+                if (msg.filename == NULL) {
+                    printf("ERROR: Message type %d without a filename\n", recv_pdu->msg_type);
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_UNKNOWN);
+                    return -1;
+                }
+
+                if (recv_pdu->msg_type == DUFTP_MSG_REQUEST) {
+                    server_send_file(dpc, sBuff, rBuff, rbuff_sz, msg.filename, &sequence_number,
+                                     (recv_pdu->flags & DUFTP_FLAG_LZ) != 0);
+                    break;
+                }
+                if (recv_pdu->msg_type == DUFTP_MSG_DELTA_REQ) {
+                    int rc = server_delta(dpc, sBuff, rBuff, rbuff_sz, &msg, &sequence_number);
+                    if (rc < 0)
+                        return rc;
+                    break;
+                }
+
+                //The checkpoint name is built from this path too
+                if (!server_name_ok(msg.filename)) {
+                    printf("ERROR: Refusing file name %s\n", msg.filename);
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_PERMISSION);
+                    return -1;
+                }
+                snprintf(output_filename, sizeof(output_filename), "./infile/%s", msg.filename);
+
+                //A RESUME just asks what we have, the checkpoint rides back in the ACK
+                if (recv_pdu->msg_type == DUFTP_MSG_RESUME) {
+                    char ckpt_filename[FNAME_SZ + 32];
+                    snprintf(ckpt_filename, sizeof(ckpt_filename), "%s%s", output_filename, DUFTP_CKPT_SUFFIX);
+                    duftp_pdu *ack = duftp_init_pdu(sBuff, DUFTP_MSG_ACK, sequence_number++);
+                    ack->data_size = sizeof(duftp_ckpt);
+                    ckpt_lookup(output_filename, ckpt_filename, recv_pdu->total_size,
+                                (duftp_ckpt *)duftp_data(ack));
+                    duftp_send(dpc, ack);
+                    break;
+                }
+
+                rx_close(&rx, false);
+                dedup_rx_reset(drx);
+                if (recv_pdu->flags & DUFTP_FLAG_STRIPE) {
+                    if (rx_open_stripe(&rx, output_filename, recv_pdu->total_size, &msg) < 0) {
+                        printf("ERROR: Cannot receive stripe of %s\n", output_filename);
+                        duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_UNKNOWN);
+                        return -1;
+                    }
+                } else {
+                    if (rx_open(&rx, output_filename, recv_pdu->total_size, recv_pdu->offset) < 0) {
+                        printf("ERROR: Cannot open file %s for writing\n", output_filename);
+                        duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_FILE_NOT_FOUND);
+                        return -1;
+                    }
+                    if (rx.ckpt.offset > 0)
+                        printf("Resuming file: %s at %lld of %lld bytes\n", msg.filename,
+                               (long long)rx.ckpt.offset, (long long)rx.total_size);
+                    else
+                        printf("Receiving file: %s (size: %lld bytes)\n", 
+                               msg.filename, (long long)rx.total_size);
+                }
+                
+                //Send acknowledgment, accepting compression if it was offered
+                duftp_pdu *ack = duftp_init_pdu(sBuff, DUFTP_MSG_ACK, sequence_number++);
+                ack->flags = recv_pdu->flags & DUFTP_FLAG_LZ;
+                duftp_send(dpc, ack);
+                break;
+                
+            case DUFTP_MSG_CHUNKS:
+                if ((recv_pdu->offset == 0 && !server_name_ok(msg.filename)) ||
+                    dedup_rx_chunks(drx, &msg) < 0) {
+                    printf("ERROR: Bad chunk list\n");
+                    dedup_rx_reset(drx);
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_UNKNOWN);
+                    return -1;
+                }
+                if (recv_pdu->offset == 0)
+                    snprintf(output_filename, sizeof(output_filename), "./infile/%s", msg.filename);
+                if (recv_pdu->flags & DUFTP_FLAG_CKPT)
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ACK, sequence_number++, DUFTP_ERR_NONE);
+                if (!(recv_pdu->flags & DUFTP_FLAG_LAST))
+                    break;
+
+                rx_close(&rx, false);
+                if (drx->listed != recv_pdu->total_size ||
+                    rx_open(&rx, output_filename, recv_pdu->total_size, 0) < 0) {
+                    printf("ERROR: Cannot receive file %s\n", output_filename);
+                    dedup_rx_reset(drx);
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_FILE_NOT_FOUND);
+                    return -1;
+                }
+                printf("Receiving file: %s (size: %lld bytes, %d chunks)\n",
+                       output_filename, (long long)rx.total_size, drx->count);
+                if (dedup_rx_fill(drx, &rx, dpc, sBuff, &sequence_number) < 0) {
+                    rx_close(&rx, false);
+                    return -1;
+                }
+                break;
+
+            case DUFTP_MSG_MANIFEST:
+                if (trx->active)
+                    tree_rx_reset(trx);
+                if (tree_rx_manifest(trx, &msg) < 0) {
+                    printf("ERROR: Bad directory manifest\n");
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_UNKNOWN);
+                    return -1;
+                }
+                if (recv_pdu->flags & DUFTP_FLAG_CKPT)
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ACK, sequence_number++, DUFTP_ERR_NONE);
+                break;
+
+            case DUFTP_MSG_DATA:
+                if (trx->active) {
+                    if (tree_rx_data(trx, &msg) < 0) {
+                        duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_DISK_FULL);
+                        return -1;
+                    }
+                    if (recv_pdu->flags & DUFTP_FLAG_CKPT)
+                        duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ACK, sequence_number++, DUFTP_ERR_NONE);
+                    break;
+                }
+                if (rx.fd < 0) {
+                    printf("ERROR: Received data without filename\n");
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_UNKNOWN);
+                    return -1;
+                }
+                if (rx_data(&rx, &msg) < 0) {
+                    rx_close(&rx, false);
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_DISK_FULL);
+                    return -1;
+                }
+                
+                //Data streams in, only checkpoint blocks are acknowledged.  Get
+                //the data on disk before the checkpoint says it is there
+                if (!(recv_pdu->flags & DUFTP_FLAG_CKPT))
+                    break;
+                rx_checkpoint(&rx);
+                duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ACK, sequence_number++, DUFTP_ERR_NONE);
+                break;
+                
+            case DUFTP_MSG_COMPLETE:
+                if (trx->active) {
+                    printf("Directory transfer complete: %d files, %lld bytes received\n",
+                           trx->tree.count, (long long)trx->bytes_received);
+                    tree_rx_reset(trx);
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ACK, sequence_number++, DUFTP_ERR_NONE);
+                    break;
+                }
+                //File transfer complete
+                printf("File transfer complete: %lld bytes received\n", (long long)rx.bytes_received);
+                if (rx.fd >= 0 && rx_verify(&rx, &msg) < 0) {
+                    rx_discard(&rx);
+                    dedup_rx_reset(drx);
+                    duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_CHECKSUM);
+                    break;
+                }
+                rx_close(&rx, true);
+                if (drx->active) {
+                    uint64_t root;
+                    if (msg.pdu->data_size == DUFTP_ROOT_SZ) {
+                        memcpy(&root, msg.data, sizeof(root));
+                        if (dustore_commit(rx.path, root, drx->chunks, drx->count) < 0)
+                            printf("Warning: could not add %s to the chunk store\n", rx.path);
+                    }
+                    dedup_rx_reset(drx);
+                }
+                duftp_send_ctl(dpc, sBuff, DUFTP_MSG_ACK, sequence_number++, DUFTP_ERR_NONE);
+                printf("Waiting for client to disconnect...\n");
+                break;
+                
+            case DUFTP_MSG_ERROR:
+                printf("Error from client: %d\n", recv_pdu->error_code);
+                rx_close(&rx, false);
+                break;
+                
+            default:
+                printf("Unknown message type: %d\n", recv_pdu->msg_type);
+                break;
+        }
+    }
+}
+
+/*
+ *  Asks the server how much of this file it already holds and checks that
+ *  prefix against our copy.  Returns the offset to continue from.
+ */
+static int64_t client_resume_offset(dp_connp dpc, duio_src *src, const char *filename){
+    duftp_msg ack;
+    duftp_ckpt ckpt;
+
+    duftp_pdu *send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_RESUME, sequence_number++);
+    send_pdu->total_size = src->size;
+    duftp_set_filename(send_pdu, filename);
+    duftp_send(dpc, send_pdu);
+    if (wait_ack(dpc, rbuffer, sizeof(rbuffer), &ack) < 0 ||
+        ack.pdu->data_size != sizeof(duftp_ckpt))
+        return 0;
+
+    memcpy(&ckpt, ack.data, sizeof(ckpt));
+    if (ckpt.offset <= 0 || ckpt.offset > src->size)
+        return 0;
+    if (duhash_update(DUHASH_INIT, src->base, ckpt.offset) != ckpt.hash) {
+        printf("Server copy of %s does not match ours, sending all of it\n", filename);
+        return 0;
+    }
+    return ckpt.offset;
+}
+
+static char *client_filename(void){
+    int len = strlen(full_file_path);
+    while (len > 1 && full_file_path[len - 1] == '/')
+        full_file_path[--len] = '\0';
+    char *filename = strrchr(full_file_path, '/');
+    return (filename == NULL) ? full_file_path : filename + 1;
+}
+
+/*
+ *  Directory transfers, send side.  Blocks are cut from the concatenation of
+ *  every file in the manifest and sent as a gather list straight out of the
+ *  file mappings, so a block can hold pieces of up to DUFTP_MAX_PIECES small
+ *  files.  A mapping stays open until the block holding its last piece is
+ *  out.
+ */
+static int64_t send_tree_blocks(dp_connp dpc, dutree *tree, const char *root){
+    struct iovec iov[1 + DUFTP_MAX_PIECES];
+    duio_src done[DUFTP_MAX_PIECES];
+    duio_src cur;
+    bool cur_open = false;
+    int idx = 0, blocks_sent = 0, ndone;
+    int64_t file_off = 0, offset = 0;
+    char path[PATH_MAX];
+
+    duftp_pdu *send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_DATA, 0);
+    iov[0].iov_base = send_pdu;
+    iov[0].iov_len = sizeof(duftp_pdu);
+    while (offset < tree->total_size) {
+        int npieces = 0;
+        ndone = 0;
+        send_pdu->data_size = 0;
+        while (send_pdu->data_size < DUFTP_MAX_DATA_SIZE && npieces < DUFTP_MAX_PIECES &&
+               idx < tree->count) {
+            dutree_ent *ent = &tree->ents[idx];
+            if (ent->size == 0) {
+                idx++;
+                continue;
+            }
+            if (!cur_open) {
+                snprintf(path, sizeof(path), "%s/%s", root, ent->path);
+                if (duio_src_open(&cur, path) < 0) {
+                    printf("ERROR: Cannot open file %s\n", path);
+                    goto fail;
+                }
+                cur_open = true;
+                if (cur.size < ent->size) {
+                    printf("ERROR: %s shrank while sending\n", path);
+                    goto fail;
+                }
+            }
+            int64_t room = DUFTP_MAX_DATA_SIZE - send_pdu->data_size;
+            int n = (ent->size - file_off < room) ? ent->size - file_off : room;
+            iov[1 + npieces].iov_base = cur.base + file_off;
+            iov[1 + npieces].iov_len = n;
+            npieces++;
+            send_pdu->data_size += n;
+            file_off += n;
+            if (file_off == ent->size) {
+                done[ndone++] = cur;
+                cur_open = false;
+                file_off = 0;
+                idx++;
+            }
+        }
+
+        send_pdu->seq_num = sequence_number++;
+        send_pdu->offset = offset;
+        send_pdu->flags = (++blocks_sent % DUFTP_CKPT_INTERVAL == 0) ?
+                            DUFTP_FLAG_CKPT : DUFTP_FLAG_NONE;
+        int rc = dpsendv(dpc, iov, 1 + npieces);
+        offset += send_pdu->data_size;
+        dumetrics_add(&metrics, send_pdu->data_size);
+        for (int i = 0; i < ndone; i++)
+            duio_src_close(&done[i]);
+        ndone = 0;
+        if (rc < 0)
+            goto fail;
+        if (send_pdu->flags == DUFTP_FLAG_CKPT &&
+            wait_ack(dpc, rbuffer, sizeof(rbuffer), NULL) < 0)
+            goto fail;
+    }
+    
+    send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_COMPLETE, sequence_number++);
+    duftp_send(dpc, send_pdu);
+    if (wait_ack(dpc, rbuffer, sizeof(rbuffer), NULL) < 0)
+        return -1;
+    return offset;
+
+fail:
+    for (int i = 0; i < ndone; i++)
+        duio_src_close(&done[i]);
+    if (cur_open)
+        duio_src_close(&cur);
+    return -1;
+}
+
+/*
+ *  Uploads the directory at full_file_path, and everything below it, into
+ *  the server's ./infile in one session.
+ */
+void start_client_tree(dp_connp dpc){
+    dutree tree;
+    int next = 0;
+    char *dirname = client_filename();
+
+    if(!dpc->isConnected) {
+        printf("Client not connected\n");
+        return;
+    }
+
+    dutree_init(&tree);
+    if (dutree_scan(&tree, full_file_path) < 0) {
+        printf("ERROR: Cannot read directory %s\n", full_file_path);
+        exit(-1);
+    }
+    printf("Sending directory: %s (%d files, %lld bytes)\n", dirname,
+           tree.count, (long long)tree.total_size);
+    dumetrics_expect(&metrics, tree.total_size);
+
+    //The manifest goes out in as many PDUs as it needs, the last one is ACK'd
+    sequence_number = 0;
+    do {
+        duftp_pdu *send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_MANIFEST, sequence_number++);
+        duftp_set_filename(send_pdu, dirname);
+        send_pdu->total_size = tree.total_size;
+        int first = next;
+        send_pdu->data_size = dutree_encode(&tree, &next, duftp_data(send_pdu),
+                                            DUFTP_MAX_DATA_SIZE);
+        if (next == first && next < tree.count) {
+            printf("ERROR: Path too long: %s\n", tree.ents[next].path);
+            dutree_free(&tree);
+            return;
+        }
+        send_pdu->flags = (next == tree.count) ? DUFTP_FLAG_CKPT : DUFTP_FLAG_NONE;
+        duftp_send(dpc, send_pdu);
+    } while (next < tree.count);
+
+    if (wait_ack(dpc, rbuffer, sizeof(rbuffer), NULL) == 0) {
+        int64_t sent = send_tree_blocks(dpc, &tree, full_file_path);
+        if (sent >= 0) {
+            printf("Directory transfer complete: %d files, %lld bytes sent\n",
+                   tree.count, (long long)sent);
+            printf("Disconnecting from server...\n");
+            dpdisconnect(dpc);
+        }
+    }
+    dutree_free(&tree);
+}
+
+/*
+ *  Delta upload, client side.  The ops are packed into DELTA PDUs as they are
+ *  found.  A COPY that continues the previous one just grows it, so runs of
+ *  unchanged blocks cost one op.
+ */
+typedef struct delta_tx {
+    dp_connp    dpc;
+    duftp_pdu   *pdu;
+    int         used;               //bytes of ops in the current PDU
+    int         last_op;            //offset of its last op, -1 if none
+    int         pdus;
+    int64_t     literal;
+    int64_t     copied;
+} delta_tx;
+
+static void delta_start_pdu(delta_tx *tx){
+    tx->pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_DELTA, sequence_number++);
+    tx->used = 0;
+    tx->last_op = -1;
+}
+
+static int delta_flush(delta_tx *tx){
+    if (tx->used == 0)
+        return 0;
+    tx->pdu->data_size = tx->used;
+    tx->pdu->flags = (++tx->pdus % DUFTP_CKPT_INTERVAL == 0) ? DUFTP_FLAG_CKPT : DUFTP_FLAG_NONE;
+    if (duftp_send(tx->dpc, tx->pdu) < 0)
+        return -1;
+    dumetrics_add(&metrics, tx->used);
+    if (tx->pdu->flags == DUFTP_FLAG_CKPT && wait_ack(tx->dpc, rbuffer, sizeof(rbuffer), NULL) < 0)
+        return -1;
+    delta_start_pdu(tx);
+    return 0;
+}
+
+static int delta_copy(delta_tx *tx, int64_t src_offset, int len){
+    char *ops = duftp_data(tx->pdu);
+    duftp_delta_op op;
+
+    tx->copied += len;
+    if (tx->last_op >= 0) {
+        memcpy(&op, ops + tx->last_op, sizeof(op));
+        if (op.type == DUFTP_OP_COPY && op.src_offset + op.len == src_offset &&
+            op.len <= INT32_MAX - len) {
+            op.len += len;
+            memcpy(ops + tx->last_op, &op, sizeof(op));
+            return 0;
+        }
+    }
+    if (tx->used + (int)sizeof(op) > DUFTP_MAX_DATA_SIZE && delta_flush(tx) < 0)
+        return -1;
+    op.type = DUFTP_OP_COPY;
+    op.len = len;
+    op.src_offset = src_offset;
+    ops = duftp_data(tx->pdu);
+    memcpy(ops + tx->used, &op, sizeof(op));
+    tx->last_op = tx->used;
+    tx->used += sizeof(op);
+    return 0;
+}
+
+static int delta_literal(delta_tx *tx, const char *data, int64_t len){
+    tx->literal += len;
+    while (len > 0) {
+        duftp_delta_op op = { .type = DUFTP_OP_LITERAL, .src_offset = 0 };
+        if (tx->used + (int)sizeof(op) >= DUFTP_MAX_DATA_SIZE && delta_flush(tx) < 0)
+            return -1;
+        int room = DUFTP_MAX_DATA_SIZE - tx->used - sizeof(op);
+        op.len = (len < room) ? len : room;
+        char *ops = duftp_data(tx->pdu);
+        memcpy(ops + tx->used, &op, sizeof(op));
+        memcpy(ops + tx->used + sizeof(op), data, op.len);
+        tx->last_op = tx->used;
+        tx->used += sizeof(op) + op.len;
+        data += op.len;
+        len -= op.len;
+    }
+    return 0;
+}
+
+//Collects the server's signatures, NULL (and *nsigs < 0) on failure
+static duftp_sig *client_recv_sigs(dp_connp dpc, int64_t *nsigs){
+    duftp_sig *sigs = NULL;
+    duftp_msg msg;
+    int64_t have = 0;
+
+    *nsigs = -1;
+    while (1) {
+        int rcvSz = duftp_recv(dpc, rbuffer, sizeof(rbuffer), &msg);
+        if (rcvSz == DP_ERROR_BAD_DGRAM)
+            continue;
+        if (rcvSz < 0 || msg.pdu->msg_type != DUFTP_MSG_SIGS) {
+            if (rcvSz >= 0 && msg.pdu->msg_type == DUFTP_MSG_ERROR)
+                printf("Error from server: %d\n", msg.pdu->error_code);
+            break;
+        }
+        if (sigs == NULL && msg.pdu->total_size > 0) {
+            sigs = malloc(msg.pdu->total_size * sizeof(duftp_sig));
+            if (sigs == NULL)
+                break;
+        }
+        int n = msg.pdu->data_size / sizeof(duftp_sig);
+        if (msg.pdu->offset != have || have + n > msg.pdu->total_size)
+            break;
+        memcpy(&sigs[have], msg.data, n * sizeof(duftp_sig));
+        have += n;
+        if (msg.pdu->flags & DUFTP_FLAG_LAST) {
+            *nsigs = have;
+            return sigs;
+        }
+    }
+    free(sigs);
+    return NULL;
+}
+
+/*
+ *  Walks our file with the rolling checksum looking for blocks the server
+ *  already has.  Signatures are bucketed by weak checksum, only a weak hit
+ *  pays for the strong hash.
+ */
+static int delta_scan(delta_tx *tx, const char *base, int64_t size, duftp_sig *sigs, int64_t nsigs){
+    const int64_t blk = DUFTP_DELTA_BLOCK;
+    int nbuckets = 1;
+    while (nbuckets < 2 * nsigs)
+        nbuckets <<= 1;
+    int *head = malloc(nbuckets * sizeof(int));
+    int *next = malloc((nsigs + 1) * sizeof(int));
+    if (head == NULL || next == NULL) {
+        printf("ERROR: Out of memory indexing %lld server blocks\n", (long long)nsigs);
+        free(head);
+        free(next);
+        duftp_send_ctl(tx->dpc, sbuffer, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_UNKNOWN);
+        return -1;
+    }
+    for (int i = 0; i < nbuckets; i++)
+        head[i] = -1;
+    for (int i = nsigs - 1; i >= 0; i--) {
+        int b = sigs[i].weak & (nbuckets - 1);
+        next[i] = head[b];
+        head[b] = i;
+    }
+
+    int64_t pos = 0, literal_start = 0;
+    uint32_t weak = (size >= blk) ? duhash_weak(base, blk) : 0;
+    int rc = 0;
+    while (nsigs > 0 && pos + blk <= size) {
+        int match = -1;
+        bool have_strong = false;
+        uint64_t strong[2];
+        for (int i = head[weak & (nbuckets - 1)]; i >= 0; i = next[i]) {
+            if (sigs[i].weak != weak)
+                continue;
+            if (!have_strong) {
+                delta_strong(base + pos, strong);
+                have_strong = true;
+            }
+            if (sigs[i].strong[0] == strong[0] && sigs[i].strong[1] == strong[1]) {
+                match = i;
+                break;
+            }
+        }
+        if (match >= 0) {
+            if ((rc = delta_literal(tx, base + literal_start, pos - literal_start)) < 0 ||
+                (rc = delta_copy(tx, match * blk, blk)) < 0)
+                break;
+            pos += blk;
+            literal_start = pos;
+            if (pos + blk <= size)
+                weak = duhash_weak(base + pos, blk);
+            continue;
+        }
+        if (pos + blk < size)
+            weak = duhash_roll(weak, base[pos], base[pos + blk], blk);
+        pos++;
+    }
+    if (rc == 0)
+        rc = delta_literal(tx, base + literal_start, size - literal_start);
+
+    free(head);
+    free(next);
+    return rc;
+}
+
+void start_client_delta(dp_connp dpc){
+    duio_src src;
+    int64_t nsigs;
+    delta_tx tx = { .dpc = dpc };
+
+    if(!dpc->isConnected) {
+        printf("Client not connected\n");
+        return;
+    }
+    if(duio_src_open(&src, full_file_path) < 0){
+        printf("ERROR: Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    char *filename = client_filename();
+
+    sequence_number = 0;
+    duftp_pdu *send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_DELTA_REQ, sequence_number++);
+    send_pdu->total_size = src.size;
+    duftp_set_filename(send_pdu, filename);
+    duftp_send(dpc, send_pdu);
+
+    duftp_sig *sigs = client_recv_sigs(dpc, &nsigs);
+    if (nsigs < 0) {
+        printf("ERROR: Did not get signatures from the server\n");
+        duio_src_close(&src);
+        return;
+    }
+    printf("Sending delta: %s (size: %lld bytes, %lld server blocks)\n",
+           filename, (long long)src.size, (long long)nsigs);
+
+    delta_start_pdu(&tx);
+    int rc = delta_scan(&tx, src.base, src.size, sigs, nsigs);
+    free(sigs);
+    if (rc == 0)
+        rc = delta_flush(&tx);
+    if (rc == 0) {
+        dumerkle merkle;
+        uint64_t root;
+        if (dumerkle_init(&merkle, src.size) < 0) {
+            rc = -1;
+        } else {
+            dumerkle_hash(&merkle, src.base, sysconf(_SC_NPROCESSORS_ONLN));
+            rc = dumerkle_root(&merkle, &root);
+            dumerkle_free(&merkle);
+        }
+        if (rc < 0) {
+            printf("ERROR: Out of memory for the content hash of %s\n", filename);
+            duftp_send_ctl(dpc, sbuffer, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_UNKNOWN);
+        } else {
+            send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_COMPLETE, sequence_number++);
+            duftp_set_root(send_pdu, 0, root);
+            duftp_send(dpc, send_pdu);
+            rc = wait_ack(dpc, rbuffer, sizeof(rbuffer), NULL);
+        }
+    }
+    duio_src_close(&src);
+    if (rc < 0)
+        return;
+
+    printf("Delta transfer complete: %lld literal bytes sent, %lld bytes matched\n",
+           (long long)tx.literal, (long long)tx.copied);
+    printf("Disconnecting from server...\n");
+    dpdisconnect(dpc);
+}
+
+/*
+ *  Deduplicated upload.  The file is cut into content defined chunks and the
+ *  chunk list goes to the server first, the server answers with which of the
+ *  chunks its store has.  Only the others are sent, block by block straight
+ *  from the mapping, and the COMPLETE carries the content hash of the whole
+ *  file so the server checks what it pieced together.
+ */
+static int dedup_send_list(dp_connp dpc, const char *filename, int64_t size,
+                           dustore_chunk *chunks, int count){
+    const int per_pdu = DUFTP_MAX_DATA_SIZE / sizeof(duftp_chunk);
+    int pdus = 0;
+
+    for (int first = 0; first == 0 || first < count; first += per_pdu) {
+        int n = (count - first < per_pdu) ? count - first : per_pdu;
+        duftp_pdu *pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_CHUNKS, sequence_number++);
+        pdu->total_size = size;
+        pdu->offset = first;
+        if (first == 0)
+            duftp_set_filename(pdu, filename);
+        duftp_chunk *out = (duftp_chunk *)duftp_data(pdu);
+        for (int i = 0; i < n; i++) {
+            memcpy(out[i].key, chunks[first + i].key.h, sizeof(out[i].key));
+            out[i].len = chunks[first + i].len;
+            out[i].pad = 0;
+        }
+        pdu->data_size = n * sizeof(duftp_chunk);
+        if (first + n >= count)
+            pdu->flags = DUFTP_FLAG_LAST;
+        else if (++pdus % DUFTP_CKPT_INTERVAL == 0)
+            pdu->flags = DUFTP_FLAG_CKPT;
+        if (duftp_send(dpc, pdu) < 0)
+            return -1;
+        if ((pdu->flags & DUFTP_FLAG_CKPT) && wait_ack(dpc, rbuffer, sizeof(rbuffer), NULL) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+//Collects the HAVE bitmap into have[], one bool per chunk
+static int dedup_recv_have(dp_connp dpc, bool *have, int count){
+    duftp_msg msg;
+
+    while (1) {
+        int rcvSz = duftp_recv(dpc, rbuffer, sizeof(rbuffer), &msg);
+        if (rcvSz == DP_ERROR_BAD_DGRAM)
+            continue;
+        if (rcvSz < 0)
+            return -1;
+        if (msg.pdu->msg_type == DUFTP_MSG_ERROR) {
+            printf("Error from server: %d\n", msg.pdu->error_code);
+            return -1;
+        }
+        if (msg.pdu->msg_type != DUFTP_MSG_HAVE) {
+            printf("Unexpected response from server: %d\n", msg.pdu->msg_type);
+            return -1;
+        }
+        const unsigned char *bits = (const unsigned char *)msg.data;
+        for (int i = 0; i < msg.pdu->data_size * 8; i++) {
+            int64_t idx = msg.pdu->offset + i;
+            if (idx >= 0 && idx < count)
+                have[idx] = (bits[i / 8] >> (i % 8)) & 1;
+        }
+        if (msg.pdu->flags & DUFTP_FLAG_LAST)
+            return 0;
+    }
+}
+
+void start_client_dedup(dp_connp dpc){
+    duio_src src;
+    dustore_chunk *chunks;
+    dumerkle merkle;
+    int64_t sent = 0;
+    int blocks_sent = 0;
+    int rc = -1;
+
+    if(!dpc->isConnected) {
+        printf("Client not connected\n");
+        return;
+    }
+    if(duio_src_open(&src, full_file_path) < 0){
+        printf("ERROR: Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    char *filename = client_filename();
+
+    //The content hash is only needed at the end, work it out meanwhile
+    if (dumerkle_init(&merkle, src.size) < 0) {
+        duio_src_close(&src);
+        return;
+    }
+    dumerkle_start(&merkle, src.base, sysconf(_SC_NPROCESSORS_ONLN));
+
+    int count = dustore_chunk_file(src.base, src.size, &chunks);
+    bool *have = (count >= 0) ? calloc(count + 1, sizeof(bool)) : NULL;
+    if (have == NULL) {
+        printf("ERROR: Cannot chunk file %s\n", full_file_path);
+        goto done;
+    }
+    printf("Sending file: %s (size: %lld bytes, %d chunks)\n", filename,
+           (long long)src.size, count);
+
+    sequence_number = 0;
+    if (dedup_send_list(dpc, filename, src.size, chunks, count) < 0 ||
+        dedup_recv_have(dpc, have, count) < 0)
+        goto done;
+    for (int i = 0; i < count; i++)
+        if (!have[i])
+            dumetrics_expect(&metrics, chunks[i].len);
+
+    duftp_pdu *send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_DATA, 0);
+    for (int i = 0; i < count; i++) {
+        if (have[i])
+            continue;
+        for (int64_t offset = chunks[i].offset; offset < chunks[i].offset + chunks[i].len; ) {
+            int64_t left = chunks[i].offset + chunks[i].len - offset;
+            int len = (left > DUFTP_MAX_DATA_SIZE) ? DUFTP_MAX_DATA_SIZE : left;
+            send_pdu->seq_num = sequence_number++;
+            send_pdu->offset = offset;
+            send_pdu->data_size = len;
+            send_pdu->flags = (++blocks_sent % DUFTP_CKPT_INTERVAL == 0) ?
+                                DUFTP_FLAG_CKPT : DUFTP_FLAG_NONE;
+            if (duftp_send_data(dpc, send_pdu, src.base + offset) < 0)
+                goto done;
+            if ((send_pdu->flags & DUFTP_FLAG_CKPT) &&
+                wait_ack(dpc, rbuffer, sizeof(rbuffer), NULL) < 0)
+                goto done;
+            offset += len;
+            sent += len;
+            dumetrics_add(&metrics, len);
+        }
+    }
+
+    uint64_t root;
+    int have_root = dumerkle_root(&merkle, &root);
+    send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_COMPLETE, sequence_number++);
+    duftp_set_root(send_pdu, have_root, root);
+    duftp_send(dpc, send_pdu);
+    rc = wait_ack(dpc, rbuffer, sizeof(rbuffer), NULL);
+
+done:
+    dumerkle_free(&merkle);
+    free(have);
+    free(chunks);
+    duio_src_close(&src);
+    if (rc < 0)
+        return;
+
+    printf("Deduplicated transfer complete: %lld of %lld bytes sent\n",
+           (long long)sent, (long long)src.size);
+    printf("Disconnecting from server...\n");
+    dpdisconnect(dpc);
+}
+
+/*
+ *  One stripe of a striped upload, on its own thread and connection.  It is
+ *  an ordinary upload session except that its FILENAME names the byte range
+ *  it carries.  Buffers and sequence numbers are per stripe.
+ */
+static void *client_stripe(void *arg){
+    client_stripe_ctx *ctx = arg;
+    char *sbuff = malloc(BUFF_SZ);
+    char *rbuff = malloc(BUFF_SZ);
+    duftp_msg ack;
+    int seq = 0;
+
+    ctx->sent = -1;
+    dp_connp dpc = dpClientInit(ctx->cfg->svr_ip_addr, ctx->cfg->port_number);
+    if (dpc == NULL || dpconnect(dpc) < 0) {
+        printf("ERROR: Stripe %d could not connect\n", ctx->stripe.index + 1);
+        goto out;
+    }
+    dpsetwindow(dpc, ctx->cfg->window);
+
+    duftp_pdu *send_pdu = duftp_init_pdu(sbuff, DUFTP_MSG_FILENAME, seq++);
+    send_pdu->total_size = ctx->src->size;
+    send_pdu->offset = ctx->stripe.start;
+    send_pdu->flags = DUFTP_FLAG_STRIPE | (ctx->cfg->compress ? DUFTP_FLAG_LZ : DUFTP_FLAG_NONE);
+    duftp_set_filename(send_pdu, client_filename());
+    send_pdu->data_size = sizeof(duftp_stripe);
+    memcpy(duftp_data(send_pdu), &ctx->stripe, sizeof(duftp_stripe));
+    duftp_send(dpc, send_pdu);
+    if (wait_ack(dpc, rbuff, BUFF_SZ, &ack) < 0)
+        goto out;
+
+    ctx->sent = send_blocks(dpc, sbuff, rbuff, BUFF_SZ, ctx->src, ctx->stripe.start,
+                            ctx->stripe.end, ctx->stripe.start, &seq,
+                            (ack.pdu->flags & DUFTP_FLAG_LZ) != 0);
+    if (ctx->sent >= 0)
+        dpdisconnect(dpc);
+out:
+    free(sbuff);
+    free(rbuff);
+    return NULL;
+}
+
+/*
+ *  Uploads one file over cfg->stripes connections at once.  The file is cut
+ *  into that many ranges on DUFTP_MAX_DATA_SIZE boundaries and each range
+ *  goes over its own connection from its own thread, so the transfer is no
+ *  longer held to one window and one core.  The server needs a session pool
+ *  (-n) at least that big to take all the stripes at once.
+ */
+void start_client_striped(prog_config *cfg){
+    duio_src src;
+    pthread_t threads[DUFTP_MAX_STRIPES];
+    client_stripe_ctx ctx[DUFTP_MAX_STRIPES];
+    int64_t total = 0;
+    bool ok = true;
+
+    if(duio_src_open(&src, full_file_path) < 0){
+        printf("ERROR: Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+
+    int64_t blocks = (src.size + DUFTP_MAX_DATA_SIZE - 1) / DUFTP_MAX_DATA_SIZE;
+    int64_t per = ((blocks + cfg->stripes - 1) / cfg->stripes) * DUFTP_MAX_DATA_SIZE;
+    printf("Sending file: %s (size: %lld bytes) in %d stripes\n", client_filename(),
+           (long long)src.size, cfg->stripes);
+    dumetrics_expect(&metrics, src.size);
+    for (int i = 0; i < cfg->stripes; i++) {
+        ctx[i].cfg = cfg;
+        ctx[i].src = &src;
+        ctx[i].stripe.index = i;
+        ctx[i].stripe.count = cfg->stripes;
+        ctx[i].stripe.start = (i * per < src.size) ? i * per : src.size;
+        ctx[i].stripe.end = ((i + 1) * per < src.size) ? (i + 1) * per : src.size;
+        pthread_create(&threads[i], NULL, client_stripe, &ctx[i]);
+    }
+    for (int i = 0; i < cfg->stripes; i++) {
+        pthread_join(threads[i], NULL);
+        if (ctx[i].sent < 0)
+            ok = false;
+        else
+            total += ctx[i].sent;
+    }
+    duio_src_close(&src);
+
+    if (ok)
+        printf("File transfer complete: %lld bytes sent\n", (long long)total);
+    else
+        printf("ERROR: Striped transfer failed\n");
+}
+
+void start_client(dp_connp dpc, bool compress){
+    duftp_pdu *send_pdu;
+    duio_src src;
+    duftp_msg ack;
+
+    if(!dpc->isConnected) {
+        printf("Client not connected\n");
+        return;
+    }
+
+    if(duio_src_open(&src, full_file_path) < 0){
+        printf("ERROR: Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    int64_t file_size = src.size;
+    char *filename = client_filename();
+    
+    sequence_number = 0;
+    int64_t start_offset = client_resume_offset(dpc, &src, filename);
+
+    send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_FILENAME, sequence_number++);
+    send_pdu->total_size = file_size;
+    send_pdu->offset = start_offset;
+    send_pdu->flags = compress ? DUFTP_FLAG_LZ : DUFTP_FLAG_NONE;
+    duftp_set_filename(send_pdu, filename);
+    
+    if (start_offset > 0)
+        printf("Resuming file: %s at %lld of %lld bytes\n", filename,
+               (long long)start_offset, (long long)file_size);
+    else
+        printf("Sending file: %s (size: %lld bytes)\n", filename, (long long)file_size);
+    
+    duftp_send(dpc, send_pdu);
+    if (wait_ack(dpc, rbuffer, sizeof(rbuffer), &ack) < 0) {
+        duio_src_close(&src);
+        return;
+    }
+    
+    //Only compress if the server took us up on it
+    dumetrics_expect(&metrics, file_size - start_offset);
+    int64_t sent = send_blocks(dpc, sbuffer, rbuffer, sizeof(rbuffer), &src, 0, file_size,
+                               start_offset, &sequence_number, (ack.pdu->flags & DUFTP_FLAG_LZ) != 0);
+    duio_src_close(&src);
+    if (sent < 0)
+        return;
+    
+    printf("File transfer complete: %lld bytes sent\n", (long long)sent);
+    printf("Disconnecting from server...\n");
+    dpdisconnect(dpc);
+}
+
+/*
+ *  Downloads a file from the server's ./infile into ./outfile.  The server
+ *  answers the REQUEST with a FILENAME carrying the size, then streams the
+ *  blocks exactly like an upload in the other direction.
+ */
+void start_client_get(dp_connp dpc, bool compress){
+    duftp_msg msg;
+    duftp_rx rx = { .fd = -1 };
+    char *filename = client_filename();
+    bool done = false;
+
+    if(!dpc->isConnected) {
+        printf("Client not connected\n");
+        return;
+    }
+
+    sequence_number = 0;
+    duftp_pdu *send_pdu = duftp_init_pdu(sbuffer, DUFTP_MSG_REQUEST, sequence_number++);
+    send_pdu->flags = compress ? DUFTP_FLAG_LZ : DUFTP_FLAG_NONE;
+    duftp_set_filename(send_pdu, filename);
+    duftp_send(dpc, send_pdu);
+
+    while (!done) {
+        int rcvSz = duftp_recv(dpc, rbuffer, sizeof(rbuffer), &msg);
+        if (rcvSz == DP_ERROR_BAD_DGRAM)
+            continue;
+        if (rcvSz < 0) {
+            printf("Server closed connection\n");
+            rx_close(&rx, false);
+            return;
+        }
+
+        switch (msg.pdu->msg_type) {
+            case DUFTP_MSG_FILENAME:
+                printf("Receiving file: %s (size: %lld bytes)\n", 
+                       filename, (long long)msg.pdu->total_size);
+                if (rx_open(&rx, full_file_path, msg.pdu->total_size, 0) < 0) {
+                    printf("ERROR: Cannot open file %s for writing\n", full_file_path);
+                    duftp_send_ctl(dpc, sbuffer, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_PERMISSION);
+                    done = true;
+                    break;
+                }
+                duftp_send_ctl(dpc, sbuffer, DUFTP_MSG_ACK, sequence_number++, DUFTP_ERR_NONE);
+                break;
+
+            case DUFTP_MSG_DATA:
+                if (rx.fd < 0 || rx_data(&rx, &msg) < 0) {
+                    duftp_send_ctl(dpc, sbuffer, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_DISK_FULL);
+                    done = true;
+                    break;
+                }
+                if (msg.pdu->flags & DUFTP_FLAG_CKPT)
+                    duftp_send_ctl(dpc, sbuffer, DUFTP_MSG_ACK, sequence_number++, DUFTP_ERR_NONE);
+                break;
+
+            case DUFTP_MSG_COMPLETE:
+                printf("File transfer complete: %lld bytes received\n", (long long)rx.bytes_received);
+                if (rx.fd >= 0 && rx_verify(&rx, &msg) < 0) {
+                    rx_discard(&rx);
+                    duftp_send_ctl(dpc, sbuffer, DUFTP_MSG_ERROR, sequence_number++, DUFTP_ERR_CHECKSUM);
+                    done = true;
+                    break;
+                }
+                rx_close(&rx, true);
+                duftp_send_ctl(dpc, sbuffer, DUFTP_MSG_ACK, sequence_number++, DUFTP_ERR_NONE);
+                done = true;
+                break;
+
+            case DUFTP_MSG_ERROR:
+                printf("Error from server: %d\n", msg.pdu->error_code);
+                done = true;
+                break;
+
+            default:
+                printf("Unexpected message from server: %d\n", msg.pdu->msg_type);
+                break;
+        }
+    }
+
+    rx_close(&rx, false);
+    printf("Disconnecting from server...\n");
+    dpdisconnect(dpc);
+}
+
+/*
+ *  One line of counters at the end of a client run or a server session, the
+ *  benchmark (du-bench) reads these rather than timing the whole process.
+ */
+static double elapsed_ms(const struct timespec *since){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+static double tv_ms(const struct timeval *tv){
+    return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static void print_stats(const char *role, const dp_stats *st, double wall_ms,
+                        double user_ms, double sys_ms){
+    printf("STATS role=%s wall_ms=%.3f user_ms=%.3f sys_ms=%.3f pdus_sent=%lld pdus_rcvd=%lld "
+           "dgrams_sent=%lld dgrams_rcvd=%lld wire_sent=%lld wire_rcvd=%lld syscalls=%lld\n",
+           role, wall_ms, user_ms, sys_ms, st->msgsSent, st->msgsRcvd, st->dgramsSent,
+           st->dgramsRcvd, st->bytesSent, st->bytesRcvd, st->syscalls);
+    fflush(stdout);
+}
+
+//Runs one accepted session to the end with the given buffers
+static int server_session(dp_connp dpc, void *sBuff, void *rBuff){
+    struct timespec start;
+    struct rusage ru0, ru1;
+    dp_stats before = dpc->stats, session;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    getrusage(RUSAGE_THREAD, &ru0);
+    dumetrics_session_start(&metrics);
+    dpsettimeout(dpc, DUFTP_SESSION_TIMEOUT);
+    int rc = server_loop(dpc, sBuff, rBuff, BUFF_SZ, BUFF_SZ);
+    if (rc != DP_CONNECTION_CLOSED)
+        dpc->isConnected = false;
+    dpsettimeout(dpc, 0);
+    dumetrics_session_end(&metrics);
+
+    getrusage(RUSAGE_THREAD, &ru1);
+    dpstats_diff(&session, &dpc->stats, &before);
+    print_stats("server", &session, elapsed_ms(&start),
+                tv_ms(&ru1.ru_utime) - tv_ms(&ru0.ru_utime),
+                tv_ms(&ru1.ru_stime) - tv_ms(&ru0.ru_stime));
+    return rc;
+}
+
+void start_server(dp_connp dpc){
+    char *sbuff = malloc(BUFF_SZ);
+    char *rbuff = malloc(BUFF_SZ);
+
+    printf("Server started. Waiting for connections...\n");
+    server_session(dpc, sbuff, rbuff);
+    free(sbuff);
+    free(rbuff);
+}
+
+static void session_queue_init(session_queue *q, int capacity){
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->slots = malloc(capacity * sizeof(dp_connp));
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+}
+
+static void session_queue_push(session_queue *q, dp_connp dpc){
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->slots[(q->head + q->count) % q->capacity] = dpc;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static dp_connp session_queue_pop(session_queue *q){
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    dp_connp dpc = q->slots[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return dpc;
+}
+
+/*
+ *  A session pool thread.  It owns one pair of message buffers for its whole
+ *  life and runs whatever session the acceptors hand it, each on the session's
+ *  own dp connection, so no two sessions share any state.
+ */
+static void *session_worker(void *arg){
+    session_queue *q = arg;
+    char *sbuff = malloc(BUFF_SZ);
+    char *rbuff = malloc(BUFF_SZ);
+
+    while(1) {
+        dp_connp dpc = session_queue_pop(q);
+        server_session(dpc, sbuff, rbuff);
+        dpclose(dpc);
+    }
+    return NULL;
+}
+
+/*
+ *  One server worker.  Each worker owns a SO_REUSEPORT socket bound to the
+ *  server port and its own dp connection, and is pinned to a core.  The kernel
+ *  shards clients across the sockets so workers never share anything on the
+ *  datagram path.  Workers serve one session at a time, forever, unless
+ *  there is a session pool, then they just accept clients and queue them.
+ */
+static void *server_worker(void *arg){
+    server_worker_ctx *ctx = arg;
+    cpu_set_t cpus;
+    dp_connp dpc;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(ctx->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    dpc = dpServerInitShared(ctx->port_number);
+    if (dpc == NULL) {
+        printf("ERROR: Worker %d could not open its socket\n", ctx->worker_id);
+        return NULL;
+    }
+    dpsetwindow(dpc, ctx->window);
+
+    //With a session pool this worker only accepts, sessions run on the pool
+    if (ctx->queue != NULL) {
+        while(1) {
+            dp_connp session = dpaccept(dpc);
+            if (session != NULL)
+                session_queue_push(ctx->queue, session);
+        }
+    }
+
+    char *sbuff = malloc(BUFF_SZ);
+    char *rbuff = malloc(BUFF_SZ);
+
+    while(1) {
+        if (dplisten(dpc) < 0)
+            continue;
+        printf("Worker %d: session started\n", ctx->worker_id);
+        server_session(dpc, sbuff, rbuff);
+        printf("Worker %d: session ended\n", ctx->worker_id);
+    }
+    return NULL;
+}
+
+/*
+ *  Starts the long running server.  Without a session pool every worker runs
+ *  its own sessions.  With one (-n) the workers become acceptors, one per
+ *  worker or just one, and the sessions they accept run concurrently on the
+ *  pool threads.
+ */
+static void start_server_workers(prog_config *cfg){
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    session_queue *queue = NULL;
+
+    if (cfg->workers < 1)
+        cfg->workers = 1;
+    pthread_t *threads = malloc(cfg->workers * sizeof(pthread_t));
+    server_worker_ctx *ctx = malloc(cfg->workers * sizeof(server_worker_ctx));
+
+    if (cfg->sessions > 0) {
+        queue = malloc(sizeof(session_queue));
+        session_queue_init(queue, cfg->sessions);
+        for (int i = 0; i < cfg->sessions; i++) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, session_worker, queue) != 0) {
+                perror("Error starting session thread");
+                exit(-1);
+            }
+            pthread_detach(tid);
+        }
+        printf("Server started with %d sessions. Waiting for connections...\n", cfg->sessions);
+    } else {
+        printf("Server started with %d workers. Waiting for connections...\n", cfg->workers);
+    }
+
+    for (int i = 0; i < cfg->workers; i++) {
+        ctx[i].worker_id = i;
+        ctx[i].cpu = i % ncpu;
+        ctx[i].port_number = cfg->port_number;
+        ctx[i].window = cfg->window;
+        ctx[i].queue = queue;
+        pthread_create(&threads[i], NULL, server_worker, &ctx[i]);
+    }
+    printf("Server listening on port %d\n", cfg->port_number);
+    fflush(stdout);
+    for (int i = 0; i < cfg->workers; i++)
+        pthread_join(threads[i], NULL);
+
+    free(ctx);
+    free(threads);
+}
+
+
+int main(int argc, char *argv[])
+{
+    prog_config cfg;
+    int cmd;
+    dp_connp dpc;
+    int rc;
+
+    // Process the parameters and init the header
+    cmd = initParams(argc, argv, &cfg);
+
+    if (cfg.quiet)
+        dpdebug(false);
+
+    printf("MODE %d\n", cfg.prog_mode);
+    printf("PORT %d\n", cfg.port_number);
+    printf("FILE NAME: %s\n", cfg.file_name);
+
+    switch(cmd){
+        case PROG_MD_CLI:
+            // For client, we still need the file path to read from
+            snprintf(full_file_path, sizeof(full_file_path), "./outfile/%s", cfg.file_name);
+            struct stat st;
+            bool is_dir = (stat(full_file_path, &st) == 0 && S_ISDIR(st.st_mode));
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            dumetrics_init(&metrics, "client");
+            if (dumetrics_start(&metrics, cfg.interval_ms, cfg.metrics_path) < 0)
+                printf("Warning: no progress reports, cannot start the reporter\n");
+
+            if (cfg.stripes > 1 && !cfg.get_file && !cfg.delta && !cfg.dedup && !is_dir) {
+                start_client_striped(&cfg);
+            } else {
+                dpc = dpClientInit(cfg.svr_ip_addr, cfg.port_number);
+                rc = dpconnect(dpc);
+                if (rc < 0) {
+                    perror("Error establishing connection");
+                    exit(-1);
+                }
+                dpsetwindow(dpc, cfg.window);
+
+                if (cfg.get_file)
+                    start_client_get(dpc, cfg.compress);
+                else if (cfg.delta)
+                    start_client_delta(dpc);
+                else if (cfg.dedup && !is_dir)
+                    start_client_dedup(dpc);
+                else if (is_dir)
+                    start_client_tree(dpc);
+                else
+                    start_client(dpc, cfg.compress);
+            }
+
+            dumetrics_stop(&metrics);
+            //Every connection is closed by now, so the totals cover the run
+            struct rusage ru;
+            dp_stats totals;
+            getrusage(RUSAGE_SELF, &ru);
+            dptotals(&totals);
+            print_stats("client", &totals, elapsed_ms(&start),
+                        tv_ms(&ru.ru_utime), tv_ms(&ru.ru_stime));
+            exit(0);
+            break;
+
+        case PROG_MD_SVR:
+            dumetrics_init(&metrics, "server");
+            if (dumetrics_start(&metrics, cfg.interval_ms, cfg.metrics_path) < 0)
+                printf("Warning: no progress reports, cannot start the reporter\n");
+            if (dustore_open(DUFTP_STORE_DIR) < 0)
+                printf("Warning: chunk store %s unavailable, nothing will deduplicate\n",
+                       DUFTP_STORE_DIR);
+            if (cfg.workers > 0 || cfg.sessions > 0) {
+                start_server_workers(&cfg);
+                break;
+            }
+            dpc = dpServerInit(cfg.port_number);
+            if (dpc == NULL) {
+                perror("Error opening server socket");
+                exit(-1);
+            }
+            //Scripts wait for this line before they start a client
+            printf("Server listening on port %d\n", cfg.port_number);
+            fflush(stdout);
             rc = dplisten(dpc);
             if (rc < 0) {
                 perror("Error establishing connection");
                 exit(-1);
             }
+            dpsetwindow(dpc, cfg.window);
+            dpsettimeout(dpc, DUFTP_SESSION_TIMEOUT);
 
             start_server(dpc);
+            dumetrics_stop(&metrics);
             break;
         default:
             printf("ERROR: Unknown Program Mode. Mode set is %d\n", cmd);
@@ -1,11 +1,23 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "du-tree.h"
+#include "du-hash.h"
+#include "du-store.h"
+#include "du-io.h"
+
 #define PROG_MD_CLI     0
 #define PROG_MD_SVR     1
 #define DEF_PORT_NO     2080
 #define FNAME_SZ        150
 #define PROG_DEF_FNAME  "test.c"
 #define PROG_DEF_SVR_ADDR   "127.0.0.1"
+#define PROG_DEF_WORKERS    0       //0 = classic single session server
+#define PROG_DEF_WINDOW     32
+#define PROG_DEF_SESSIONS   0       //0 = no session pool
 
 //The message types
 #define DUFTP_MSG_FILENAME  1
@@ -13,7 +25,14 @@
 #define DUFTP_MSG_ERROR     3
 #define DUFTP_MSG_COMPLETE  4
 #define DUFTP_MSG_ACK       5
-#define DUFTP_MSG_REQUEST   6
+#define DUFTP_MSG_REQUEST   6       //GET: ask the server to send a file
+#define DUFTP_MSG_RESUME    7       //ask for the server's checkpoint of a file
+#define DUFTP_MSG_MANIFEST  8       //part of a directory manifest, see du-tree.h
+#define DUFTP_MSG_DELTA_REQ 9       //ask for signatures of the server's copy
+#define DUFTP_MSG_SIGS      10      //block signatures, data is duftp_sig[]
+#define DUFTP_MSG_DELTA     11      //delta instructions, see duftp_delta_op
+#define DUFTP_MSG_CHUNKS    12      //chunk list of a deduplicated upload
+#define DUFTP_MSG_HAVE      13      //which of those chunks the server has
 
 //The error codes
 #define DUFTP_ERR_NONE          0
@@ -21,27 +40,229 @@
 #define DUFTP_ERR_PERMISSION    2
 #define DUFTP_ERR_DISK_FULL     3
 #define DUFTP_ERR_UNKNOWN       4
+#define DUFTP_ERR_CHECKSUM      5
 
 
 #define DUFTP_MAX_DATA_SIZE  4096
-#define DUFTP_PROTOCOL_VER   1
+#define DUFTP_PROTOCOL_VER   12
+
+//Most files a directory transfer DATA block may carry pieces of
+#define DUFTP_MAX_PIECES     64
+
+//PDU flags
+#define DUFTP_FLAG_NONE     0
+#define DUFTP_FLAG_CKPT     1       //receiver must ACK this DATA block
+#define DUFTP_FLAG_LAST     2       //last SIGS, CHUNKS or HAVE PDU
+#define DUFTP_FLAG_LZ       4       //DATA: block is du-lz compressed
+                                    //FILENAME/REQUEST/ACK: offer/accept it
+#define DUFTP_FLAG_STRIPE   8       //FILENAME: one stripe, data is duftp_stripe
+#define DUFTP_FLAG_HOLE     16      //DATA: a run of zeros, data is its int64_t length
+
+//Data blocks stream without application ACKs, only every DUFTP_CKPT_INTERVAL
+//th block (and COMPLETE) is acknowledged so the sender can not run away
+#define DUFTP_CKPT_INTERVAL  64
+
+//The server persists a checkpoint next to a partial file at every checkpoint
+//block.  It records how much of the file has arrived in order and a hash of
+//that prefix, the ACK to a RESUME carries it back to the client in its data
+#define DUFTP_CKPT_SUFFIX    ".ckpt"
+typedef struct duftp_ckpt {
+    int64_t  offset;
+    int64_t  total_size;
+    uint64_t hash;
+} duftp_ckpt;
+
+//Delta transfers.  The server describes its copy as one signature per
+//DUFTP_DELTA_BLOCK bytes, a weak rolling checksum and a 128 bit hash from two
+//seeded duhash_block() passes that confirms a weak hit.  The client answers
+//with ops that rebuild its file from literal bytes and from ranges of the
+//server's copy, and the COMPLETE carries the Merkle root of the whole file
+//(as for any upload) so the server can check the result before using it
+#define DUFTP_DELTA_BLOCK    1024
+#define DUFTP_SIG_SEED1      0x452821E638D01377ULL
+#define DUFTP_SIG_SEED2      0xBE5466CF34E90C6CULL
+typedef struct duftp_sig {
+    uint32_t weak;
+    uint32_t pad;
+    uint64_t strong[2];
+} duftp_sig;
+
+#define DUFTP_OP_COPY       1       //len bytes from src_offset of the old copy
+#define DUFTP_OP_LITERAL    2       //len bytes that follow the op
+typedef struct duftp_delta_op {
+    int32_t  type;
+    int32_t  len;
+    int64_t  src_offset;
+} duftp_delta_op;
+
+//A COMPLETE for a single file carries the Merkle root (dumerkle_root()) of
+//the whole file as its 8 data bytes, the receiver answers a mismatch with
+//DUFTP_ERR_CHECKSUM
+#define DUFTP_ROOT_SZ        sizeof(uint64_t)
+
+//Striping.  A large upload can be split over several connections, each a
+//session of its own sending one DUFTP_MAX_DATA_SIZE aligned byte range of
+//the file.  Its FILENAME says which range, the server writes every stripe
+//into the one file and each COMPLETE carries the content hash of its range
+#define DUFTP_MAX_STRIPES    16
+typedef struct duftp_stripe {
+    int64_t  start;
+    int64_t  end;
+    int32_t  index;
+    int32_t  count;
+} duftp_stripe;
+
+//Deduplicated uploads.  The client cuts its file into content defined chunks
+//(du-store.h) and lists them in CHUNKS PDUs, offset is the index of the
+//first chunk in the PDU and the first one carries the filename and size.
+//The server rebuilds what it can from its chunk store and answers with HAVE
+//PDUs, a bitmap where bit i set means it has chunk offset + i.  The client
+//then sends DATA for the other chunks only and finishes like an upload
+#define DUFTP_STORE_DIR      "./infile/.store"
+typedef struct duftp_chunk {
+    uint64_t key[2];
+    int32_t  len;
+    int32_t  pad;
+} duftp_chunk;
+
+//The sender asks for the next DUFTP_PREFETCH bytes of the source to be read
+//in whenever it crosses into them, so disk reads overlap with sending
+#define DUFTP_PREFETCH       (1024 * 1024)
 
-//The protocol data unit (PDU)
+//Seconds the server waits on a silent client before it gives up the session
+#define DUFTP_SESSION_TIMEOUT   10
+
+//The protocol data unit (PDU).  This fixed header is all that goes on the
+//wire for control messages, it is followed by fname_len bytes of filename
+//(NUL terminated) and data_size bytes of data when those are present
 typedef struct duftp_pdu {
     int msg_type;
     int protocol_ver;
     int seq_num;
     int data_size;
     int error_code;
-    int total_size;
-    char filename[FNAME_SZ];
-    char data[DUFTP_MAX_DATA_SIZE];
+    int flags;
+    int fname_len;
+    int64_t total_size;
+    int64_t offset;             //file offset of the data in a DATA block
 } duftp_pdu;
 
+#define DUFTP_MAX_MSG_SZ    (sizeof(duftp_pdu) + FNAME_SZ + DUFTP_MAX_DATA_SIZE)
+
+//A decoded message, filename and data point into the receive buffer
+typedef struct duftp_msg {
+    duftp_pdu *pdu;
+    char      *filename;            //NULL when the message carries none
+    char      *data;
+} duftp_msg;
+
+//Receive side state of one transfer, used by the server for uploads and by
+//the client for downloads
+typedef struct duftp_rx {
+    int         fd;                 //-1 when no file is open
+    char        path[FNAME_SZ + 16];
+    char        ckpt_path[FNAME_SZ + 32];
+    int64_t     total_size;
+    int64_t     bytes_received;
+    int64_t     end_of_data;        //highest offset written so far
+    duftp_ckpt  ckpt;
+    bool        striped;            //fd is shared with the file's other stripes
+    int64_t     range_start;        //first byte this session covers
+    int64_t     range_end;
+    char        zbuf[DUFTP_MAX_DATA_SIZE];  //decompressed block
+    dumerkle    merkle;             //content hash, checked at COMPLETE
+    duio_writer *writer;            //background writes, NULL = write directly
+} duftp_rx;
+
+//Compression runs on its own thread ahead of the sender.  Blocks come back
+//through a ring of slots, a slot stays the sender's until the block is out
+#define DUFTP_ZPIPE_DEPTH    8
+typedef struct duftp_zslot {
+    int64_t     offset;
+    int         raw_len;
+    int         len;                //bytes on the wire
+    bool        compressed;         //false = send raw from the mapping
+    char        data[DUFTP_MAX_DATA_SIZE];
+} duftp_zslot;
+
+typedef struct duftp_zpipe {
+    pthread_t       tid;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    const char      *base;
+    int64_t         start;
+    int64_t         size;
+    duftp_zslot     slots[DUFTP_ZPIPE_DEPTH];
+    int             head;
+    int             count;
+    bool            stop;
+} duftp_zpipe;
+
+//Receive side state of a directory transfer.  The manifest maps each offset
+//of the incoming stream to a file, one file is open at a time
+typedef struct duftp_tree_rx {
+    dutree      tree;
+    char        root[FNAME_SZ + 16];
+    int         cur;                //file open on fd, -1 for none
+    int         fd;
+    int64_t     bytes_received;
+    bool        active;             //manifest received, DATA goes to the tree
+} duftp_tree_rx;
+
+//Receive side state of a deduplicated upload, the file itself goes through
+//an ordinary duftp_rx once the chunk list is in
+typedef struct duftp_dedup_rx {
+    dustore_chunk *chunks;
+    int         count;
+    int         capacity;
+    int64_t     listed;             //bytes the chunks received so far cover
+    bool        active;             //chunk list done, file is being received
+} duftp_dedup_rx;
+
 typedef struct prog_config{
     int     prog_mode;
     int     port_number;
     char    svr_ip_addr[16];
     char    file_name[128];
+    int     workers;
+    int     window;
+    bool    get_file;               //client downloads instead of uploading
+    bool    delta;                  //client uploads only what differs
+    bool    compress;               //client offers per block compression
+    int     sessions;               //concurrent sessions the server runs
+    int     stripes;                //connections a client upload is split over
+    bool    dedup;                  //client skips chunks the server has stored
+    bool    quiet;                  //no per datagram debug output
+    int     interval_ms;            //progress line every this often, 0 = none
+    char    metrics_path[128];      //file the progress numbers go to, "" = none
 } prog_config;
 
+//Accepted sessions waiting for a free pool thread.  Acceptors block in push
+//while it is full, which leaves further CONNECTs waiting in the socket
+typedef struct session_queue{
+    pthread_mutex_t         lock;
+    pthread_cond_t          not_empty;
+    pthread_cond_t          not_full;
+    struct dp_connection    **slots;
+    int                     capacity;
+    int                     head;
+    int                     count;
+} session_queue;
+
+//Per thread state for one stripe of a striped upload
+typedef struct client_stripe_ctx{
+    prog_config     *cfg;
+    const duio_src  *src;           //the mapped file
+    duftp_stripe    stripe;
+    int64_t         sent;           //-1 on failure
+} client_stripe_ctx;
+
+//Per thread state for the multi-worker server
+typedef struct server_worker_ctx{
+    int     worker_id;
+    int     cpu;
+    int     port_number;
+    int     window;
+    session_queue *queue;           //NULL = serve sessions on the worker itself
+} server_worker_ctx;
+
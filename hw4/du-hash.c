@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "du-hash.h"
+
+#define DUHASH_PRIME    0x100000001b3ULL
+
+uint64_t duhash_update(uint64_t hash, const void *data, size_t len){
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= DUHASH_PRIME;
+    }
+    return hash;
+}
+
+/*
+ *  The rsync style weak checksum of a window, two 16 bit sums packed into
+ *  one word.  duhash_roll() slides the window one byte in constant time.
+ */
+uint32_t duhash_weak(const void *data, size_t len){
+    const unsigned char *p = data;
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += p[i];
+        b += (len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+uint32_t duhash_roll(uint32_t weak, unsigned char out, unsigned char in, size_t len){
+    uint32_t a = weak & 0xffff;
+    uint32_t b = weak >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - len * out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+/*
+ *  Block hash for the Merkle leaves.  The xxHash64 construction: four
+ *  independent multiply/rotate lanes over 32 byte stripes, so the CPU keeps
+ *  all four multiplies in flight, then a merge and an avalanche.  Several
+ *  GB/s per core against well under one for byte-at-a-time FNV.
+ */
+#define DUHASH_P1   0x9E3779B185EBCA87ULL
+#define DUHASH_P2   0xC2B2AE3D27D4EB4FULL
+#define DUHASH_P3   0x165667B19E3779F9ULL
+#define DUHASH_P4   0x85EBCA77C2B2AE63ULL
+#define DUHASH_P5   0x27D4EB2F165667C5ULL
+
+static inline uint64_t duhash_rotl(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t duhash_read64(const unsigned char *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t duhash_lane(uint64_t acc, uint64_t in){
+    acc += in * DUHASH_P2;
+    acc = duhash_rotl(acc, 31);
+    return acc * DUHASH_P1;
+}
+
+static inline uint64_t duhash_merge(uint64_t h, uint64_t v){
+    h ^= duhash_lane(0, v);
+    return h * DUHASH_P1 + DUHASH_P4;
+}
+
+uint64_t duhash_block(const void *data, size_t len, uint64_t seed){
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + DUHASH_P1 + DUHASH_P2;
+        uint64_t v2 = seed + DUHASH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - DUHASH_P1;
+        do {
+            v1 = duhash_lane(v1, duhash_read64(p));
+            v2 = duhash_lane(v2, duhash_read64(p + 8));
+            v3 = duhash_lane(v3, duhash_read64(p + 16));
+            v4 = duhash_lane(v4, duhash_read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = duhash_rotl(v1, 1) + duhash_rotl(v2, 7) + duhash_rotl(v3, 12) + duhash_rotl(v4, 18);
+        h = duhash_merge(h, v1);
+        h = duhash_merge(h, v2);
+        h = duhash_merge(h, v3);
+        h = duhash_merge(h, v4);
+    } else {
+        h = seed + DUHASH_P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= duhash_lane(0, duhash_read64(p));
+        h = duhash_rotl(h, 27) * DUHASH_P1 + DUHASH_P4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h ^= (uint64_t)v * DUHASH_P1;
+        h = duhash_rotl(h, 23) * DUHASH_P2 + DUHASH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * DUHASH_P5;
+        h = duhash_rotl(h, 11) * DUHASH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= DUHASH_P2;
+    h ^= h >> 29;
+    h *= DUHASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ *  Merkle tree over DUMERKLE_CHUNK sized chunks.  Leaves are independent so
+ *  they can be filled in any order, from blocks as they arrive, by several
+ *  threads over a mapping, or from disk for whatever is still missing.  The
+ *  root is folded pairwise at the end, an odd node moves up as is.  Leaves
+ *  and inner nodes use different seeds so one can not pass for the other.
+ */
+#define DUMERKLE_LEAF_SEED  0
+#define DUMERKLE_NODE_SEED  1
+
+int dumerkle_init(dumerkle *m, int64_t size){
+    memset(m, 0, sizeof(dumerkle));
+    m->size = size;
+    m->nleaves = (size + DUMERKLE_CHUNK - 1) / DUMERKLE_CHUNK;
+    if (m->nleaves == 0)
+        return 0;
+    m->leaves = malloc(m->nleaves * sizeof(uint64_t));
+    m->have = calloc(m->nleaves, 1);
+    if (m->leaves == NULL || m->have == NULL) {
+        dumerkle_free(m);
+        return -1;
+    }
+    return 0;
+}
+
+void dumerkle_free(dumerkle *m){
+    if (m->running) {
+        pthread_join(m->bg, NULL);
+        m->running = false;
+    }
+    free(m->leaves);
+    free(m->have);
+    m->leaves = NULL;
+    m->have = NULL;
+}
+
+//Only whole chunks (or the short last one) at chunk offsets make a leaf
+void dumerkle_leaf(dumerkle *m, int64_t offset, const void *data, int len){
+    if (m->leaves == NULL || offset < 0 || offset % DUMERKLE_CHUNK != 0)
+        return;
+    int64_t idx = offset / DUMERKLE_CHUNK;
+    int64_t want = m->size - offset;
+    if (want > DUMERKLE_CHUNK)
+        want = DUMERKLE_CHUNK;
+    if (idx >= m->nleaves || len != want)
+        return;
+    m->leaves[idx] = duhash_block(data, len, DUMERKLE_LEAF_SEED);
+    m->have[idx] = 1;
+}
+
+//Fills the leaves of a run of zeros, every whole chunk has the same leaf
+void dumerkle_zero(dumerkle *m, int64_t offset, int64_t len){
+    static const char zeros[DUMERKLE_CHUNK];
+    uint64_t zero_leaf = duhash_block(zeros, DUMERKLE_CHUNK, DUMERKLE_LEAF_SEED);
+
+    if (m->leaves == NULL || offset < 0)
+        return;
+    int64_t first = (offset + DUMERKLE_CHUNK - 1) / DUMERKLE_CHUNK;
+    for (int64_t i = first; i < m->nleaves && (i + 1) * DUMERKLE_CHUNK <= offset + len; i++) {
+        if ((i + 1) * DUMERKLE_CHUNK <= m->size) {
+            m->leaves[i] = zero_leaf;
+            m->have[i] = 1;
+        }
+    }
+    //The short last chunk has a leaf of its own
+    int64_t last = (m->nleaves - 1) * DUMERKLE_CHUNK;
+    if (m->size % DUMERKLE_CHUNK != 0 && last >= offset && m->size <= offset + len)
+        dumerkle_leaf(m, last, zeros, m->size - last);
+}
+
+typedef struct dumerkle_job {
+    dumerkle    *m;
+    const char  *base;
+    int64_t     first;
+    int64_t     last;
+} dumerkle_job;
+
+static void *dumerkle_worker(void *arg){
+    dumerkle_job *job = arg;
+    for (int64_t i = job->first; i < job->last; i++)
+        dumerkle_leaf(job->m, i * DUMERKLE_CHUNK, job->base + i * DUMERKLE_CHUNK,
+                      (i == job->m->nleaves - 1) ? job->m->size - i * DUMERKLE_CHUNK : DUMERKLE_CHUNK);
+    return NULL;
+}
+
+//Fills every leaf from memory, large files are split across nthreads
+void dumerkle_hash(dumerkle *m, const char *base, int nthreads){
+    if (m->size < DUMERKLE_PAR_MIN || nthreads < 2)
+        nthreads = 1;
+    pthread_t tids[nthreads];
+    dumerkle_job jobs[nthreads];
+    bool started[nthreads];
+
+    for (int t = 0; t < nthreads; t++) {
+        jobs[t].m = m;
+        jobs[t].base = base;
+        jobs[t].first = m->nleaves * t / nthreads;
+        jobs[t].last = m->nleaves * (t + 1) / nthreads;
+    }
+    for (int t = 1; t < nthreads; t++)
+        started[t] = (pthread_create(&tids[t], NULL, dumerkle_worker, &jobs[t]) == 0);
+    dumerkle_worker(&jobs[0]);
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t])
+            pthread_join(tids[t], NULL);
+        else
+            dumerkle_worker(&jobs[t]);
+    }
+}
+
+static void *dumerkle_bg(void *arg){
+    dumerkle *m = arg;
+    dumerkle_hash(m, m->base, m->nthreads);
+    return NULL;
+}
+
+//Hashes base on other threads while the caller goes on with the transfer
+int dumerkle_start(dumerkle *m, const char *base, int nthreads){
+    m->base = base;
+    m->nthreads = nthreads;
+    if (m->nleaves == 0)
+        return 0;
+    if (pthread_create(&m->bg, NULL, dumerkle_bg, m) != 0) {
+        dumerkle_hash(m, base, nthreads);
+        return 0;
+    }
+    m->running = true;
+    return 0;
+}
+
+//Reads the chunks no block supplied a leaf for back from fd, where the
+//hashed range starts at file offset base
+int dumerkle_fill_fd(dumerkle *m, int fd, int64_t base){
+    char buff[DUMERKLE_CHUNK];
+    for (int64_t i = 0; i < m->nleaves; i++) {
+        if (m->have[i])
+            continue;
+        int64_t offset = i * DUMERKLE_CHUNK;
+        int len = (m->size - offset > DUMERKLE_CHUNK) ? DUMERKLE_CHUNK : m->size - offset;
+        if (pread(fd, buff, len, base + offset) != len)
+            return -1;
+        dumerkle_leaf(m, offset, buff, len);
+    }
+    return 0;
+}
+
+//Waits for background hashing, then folds the leaves up to *root, -1 if
+//there is no memory for the fold
+int dumerkle_root(dumerkle *m, uint64_t *root){
+    if (m->running) {
+        pthread_join(m->bg, NULL);
+        m->running = false;
+    }
+    if (m->nleaves == 0) {
+        *root = duhash_block(NULL, 0, DUMERKLE_LEAF_SEED);
+        return 0;
+    }
+
+    uint64_t *level = malloc(m->nleaves * sizeof(uint64_t));
+    if (level == NULL)
+        return -1;
+    memcpy(level, m->leaves, m->nleaves * sizeof(uint64_t));
+    int64_t n = m->nleaves;
+    while (n > 1) {
+        for (int64_t i = 0; i < n; i += 2) {
+            if (i + 1 < n)
+                level[i / 2] = duhash_block(&level[i], 2 * sizeof(uint64_t), DUMERKLE_NODE_SEED);
+            else
+                level[i / 2] = level[i];
+        }
+        n = (n + 1) / 2;
+    }
+    *root = level[0];
+    free(level);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * du-hash: content hashing for du-ftp.  duhash_update() is a streaming 64 bit
+ * FNV-1a, it can be fed a file in pieces of any size and gives the same
+ * result as hashing it in one go, which is what a resumable prefix hash
+ * needs.  duhash_weak()/duhash_roll() are the cheap rolling checksum delta
+ * transfers use to find blocks the other side already has.
+ */
+#define DUHASH_INIT     0xcbf29ce484222325ULL
+
+uint64_t duhash_update(uint64_t hash, const void *data, size_t len);
+uint32_t duhash_weak(const void *data, size_t len);
+uint32_t duhash_roll(uint32_t weak, unsigned char out, unsigned char in, size_t len);
+
+/*
+ * End to end verification.  A Merkle tree over DUMERKLE_CHUNK byte chunks
+ * with duhash_block() (a four lane xxHash64 style hash) for the leaves.
+ * The sender hashes its mapping on background threads while it sends, the
+ * receiver fills leaves from blocks as they land, and the roots are compared
+ * at the end.
+ */
+#define DUMERKLE_CHUNK      4096
+#define DUMERKLE_PAR_MIN    (4 * 1024 * 1024)   //smaller files use one thread
+
+typedef struct dumerkle {
+    uint64_t    *leaves;
+    uint8_t     *have;          //leaf i has been filled
+    int64_t     nleaves;
+    int64_t     size;
+    const char  *base;          //source of background hashing
+    int         nthreads;
+    pthread_t   bg;
+    bool        running;
+} dumerkle;
+
+uint64_t duhash_block(const void *data, size_t len, uint64_t seed);
+
+int      dumerkle_init(dumerkle *m, int64_t size);
+void     dumerkle_free(dumerkle *m);
+void     dumerkle_leaf(dumerkle *m, int64_t offset, const void *data, int len);
+void     dumerkle_zero(dumerkle *m, int64_t offset, int64_t len);
+void     dumerkle_hash(dumerkle *m, const char *base, int nthreads);
+int      dumerkle_start(dumerkle *m, const char *base, int nthreads);
+int      dumerkle_fill_fd(dumerkle *m, int fd, int64_t base);
+int      dumerkle_root(dumerkle *m, uint64_t *root);
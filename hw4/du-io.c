@@ -0,0 +1,471 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "du-io.h"
+
+/*
+ *  Maps the whole source file read only.  The kernel is told we will walk it
+ *  front to back so it reads ahead aggressively.
+ */
+int duio_src_open(duio_src *src, const char *path){
+    struct stat st;
+
+    src->base = NULL;
+    src->size = 0;
+    src->fd = open(path, O_RDONLY);
+    if (src->fd < 0)
+        return -1;
+
+    if (fstat(src->fd, &st) < 0) {
+        close(src->fd);
+        return -1;
+    }
+    src->size = st.st_size;
+
+    //mmap() refuses zero length mappings, an empty file just has no base
+    if (src->size == 0)
+        return 0;
+
+    src->base = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, src->fd, 0);
+    if (src->base == MAP_FAILED) {
+        perror("mmap source file");
+        src->base = NULL;
+        close(src->fd);
+        return -1;
+    }
+    madvise(src->base, src->size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+void duio_src_close(duio_src *src){
+    if (src->base != NULL)
+        munmap(src->base, src->size);
+    close(src->fd);
+    src->base = NULL;
+}
+
+/*
+ *  True if len bytes at data are all zero.  Data blocks almost always have
+ *  a non zero byte near the front so the scan gives up early, only blocks
+ *  that really are zero get read through.  SSE2 ORs 64 bytes at a time.
+ */
+bool duio_zero(const void *data, size_t len){
+    const unsigned char *p = data;
+    size_t i = 0;
+
+    //A quick look at the first bytes settles most data blocks
+    for (; i < len && i < 16; i++) {
+        if (p[i] != 0)
+            return false;
+    }
+#ifdef __SSE2__
+    for (; i + 64 <= len; i += 64) {
+        __m128i acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+                         _mm_loadu_si128((const __m128i *)(p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+                         _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+    }
+#else
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        if (w != 0)
+            return false;
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+int64_t duio_src_zeros(const duio_src *src, int64_t offset, int64_t end, int block, int64_t *hole){
+    int64_t run = offset;
+
+    //Filesystems without SEEK_HOLE report the whole file as data
+    if (*hole < offset) {
+        off_t h = lseek(src->fd, offset, SEEK_HOLE);
+        *hole = (h < 0) ? src->size : h;
+    }
+    if (*hole == offset && offset < src->size) {
+        off_t data = lseek(src->fd, offset, SEEK_DATA);
+        if (data < 0)
+            data = (errno == ENXIO) ? src->size : offset;
+        if (data >= end)
+            run = end;
+        else
+            run = offset + (data - offset) / block * block;
+    }
+
+    while (run < end) {
+        int len = (end - run > block) ? block : end - run;
+        if (!duio_zero(src->base + run, len))
+            break;
+        run += len;
+    }
+    return run;
+}
+
+/*
+ *  The mapping cache is a short list keyed by path.  An entry is only reused
+ *  while the file on disk is still the one that was mapped, a file that was
+ *  replaced or changed since gets mapped again and the old entry goes away
+ *  once its last sender puts it back.
+ */
+typedef struct duio_cache_ent {
+    struct duio_cache_ent *next;
+    duio_src    src;
+    char        *path;
+    dev_t       dev;
+    ino_t       ino;
+    struct timespec mtime;
+    int         refs;
+    bool        stale;
+} duio_cache_ent;
+
+static pthread_mutex_t duio_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static duio_cache_ent *duio_cache_head = NULL;
+static int duio_cache_count = 0;
+
+static void duio_cache_free(duio_cache_ent *ent){
+    duio_src_close(&ent->src);
+    free(ent->path);
+    free(ent);
+}
+
+static bool duio_cache_current(duio_cache_ent *ent, struct stat *st){
+    return ent->dev == st->st_dev && ent->ino == st->st_ino &&
+           ent->src.size == st->st_size &&
+           ent->mtime.tv_sec == st->st_mtim.tv_sec &&
+           ent->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+//Drops idle entries that are stale, then the oldest idle ones over the limit
+static void duio_cache_trim(void){
+    duio_cache_ent **pp = &duio_cache_head;
+    int kept = 0;
+    while (*pp != NULL) {
+        duio_cache_ent *ent = *pp;
+        if (ent->refs == 0 && (ent->stale || kept >= DUIO_CACHE_MAX)) {
+            *pp = ent->next;
+            duio_cache_count--;
+            duio_cache_free(ent);
+            continue;
+        }
+        kept++;
+        pp = &ent->next;
+    }
+}
+
+duio_src *duio_cache_get(const char *path){
+    struct stat st;
+    duio_cache_ent *ent;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    pthread_mutex_lock(&duio_cache_lock);
+    for (ent = duio_cache_head; ent != NULL; ent = ent->next) {
+        if (ent->stale || strcmp(ent->path, path) != 0)
+            continue;
+        if (duio_cache_current(ent, &st)) {
+            ent->refs++;
+            pthread_mutex_unlock(&duio_cache_lock);
+            return &ent->src;
+        }
+        ent->stale = true;
+    }
+
+    //Not cached, map it under the lock so two sessions do not both map it
+    ent = calloc(1, sizeof(duio_cache_ent));
+    if (ent == NULL || duio_src_open(&ent->src, path) < 0) {
+        free(ent);
+        pthread_mutex_unlock(&duio_cache_lock);
+        return NULL;
+    }
+    ent->path = strdup(path);
+    ent->dev = st.st_dev;
+    ent->ino = st.st_ino;
+    ent->mtime = st.st_mtim;
+    ent->refs = 1;
+    ent->next = duio_cache_head;
+    duio_cache_head = ent;
+    duio_cache_count++;
+    duio_cache_trim();
+    pthread_mutex_unlock(&duio_cache_lock);
+    return &ent->src;
+}
+
+void duio_cache_put(duio_src *src){
+    pthread_mutex_lock(&duio_cache_lock);
+    for (duio_cache_ent *ent = duio_cache_head; ent != NULL; ent = ent->next) {
+        if (&ent->src == src) {
+            ent->refs--;
+            break;
+        }
+    }
+    duio_cache_trim();
+    pthread_mutex_unlock(&duio_cache_lock);
+}
+
+/*
+ *  Creates the destination and reserves all of its blocks up front so the
+ *  writes that follow never extend the file and the filesystem can lay it
+ *  out contiguously.  Filesystems without fallocate() fall back to setting
+ *  the size.
+ */
+int duio_dst_open(const char *path, int64_t total_size){
+    //A fresh inode rather than truncating the old one, someone may still have
+    //the old file mapped and would fault on the pages truncate takes away
+    unlink(path);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (total_size > 0 && fallocate(fd, 0, 0, total_size) < 0) {
+        if (errno != EOPNOTSUPP || ftruncate(fd, total_size) < 0) {
+            perror("preallocating destination file");
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/*
+ *  Reopens a partially received destination without truncating it so a
+ *  transfer can carry on where it stopped.
+ */
+int duio_dst_resume(const char *path, int64_t total_size){
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+        return -1;
+
+    if (total_size > 0 && fallocate(fd, 0, 0, total_size) < 0 && errno != EOPNOTSUPP) {
+        perror("preallocating destination file");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int duio_dst_write(int fd, const void *data, int len, int64_t offset){
+    const char *pos = data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, pos, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ *  Makes [offset, offset + len) read as zeros by punching it out, which
+ *  keeps the file sparse.  Where punching is not supported the zeros are
+ *  written instead, the range may hold data from an earlier attempt.
+ */
+int duio_dst_zero(int fd, int64_t offset, int64_t len){
+    static const char zeros[65536];
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+    while (len > 0) {
+        int n = (len > (int64_t)sizeof(zeros)) ? (int)sizeof(zeros) : len;
+        if (duio_dst_write(fd, zeros, n, offset) < 0)
+            return -1;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//Trims the preallocation back to what was actually received
+int duio_dst_close(int fd, int64_t final_size){
+    int rc = 0;
+    if (final_size >= 0 && ftruncate(fd, final_size) < 0)
+        rc = -1;
+    close(fd);
+    return rc;
+}
+
+typedef struct duio_wreq {
+    int         fd;
+    int         len;
+    int64_t     offset;
+    char        *data;
+} duio_wreq;
+
+struct duio_writer {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;           //workers wait here for requests
+    pthread_cond_t  idle;           //submit and drain wait here for completions
+    pthread_t       tids[DUIO_WRITER_THREADS];
+    int             nthreads;
+    int             block;
+    duio_wreq       reqs[DUIO_WRITER_DEPTH];
+    int             free_slots[DUIO_WRITER_DEPTH];
+    int             nfree;
+    int             queue[DUIO_WRITER_DEPTH];  //submitted, not yet picked up
+    int             qhead;
+    int             qcount;
+    int             inflight;       //submitted, not yet written
+    int             sleeping;       //workers waiting on work
+    int             error;          //errno of the first failed write
+    bool            stop;
+    char            *buffers;
+};
+
+static void *duio_writer_worker(void *arg){
+    duio_writer *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (w->qcount == 0 && !w->stop) {
+            w->sleeping++;
+            pthread_cond_wait(&w->work, &w->lock);
+            w->sleeping--;
+        }
+        if (w->qcount == 0)
+            break;
+        int slot = w->queue[w->qhead];
+        w->qhead = (w->qhead + 1) % DUIO_WRITER_DEPTH;
+        w->qcount--;
+        pthread_mutex_unlock(&w->lock);
+
+        duio_wreq *req = &w->reqs[slot];
+        int rc = duio_dst_write(req->fd, req->data, req->len, req->offset);
+
+        pthread_mutex_lock(&w->lock);
+        if (rc < 0 && w->error == 0)
+            w->error = errno ? errno : EIO;
+        w->free_slots[w->nfree++] = slot;
+        w->inflight--;
+        pthread_cond_broadcast(&w->idle);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+//Returns NULL if the threads can not be had, callers then write directly
+duio_writer *duio_writer_start(int block){
+    duio_writer *w = calloc(1, sizeof(duio_writer));
+    if (w == NULL)
+        return NULL;
+    w->buffers = malloc((size_t)block * DUIO_WRITER_DEPTH);
+    if (w->buffers == NULL) {
+        free(w);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->idle, NULL);
+    w->block = block;
+    for (int i = 0; i < DUIO_WRITER_DEPTH; i++) {
+        w->reqs[i].data = w->buffers + (size_t)i * block;
+        w->free_slots[i] = i;
+    }
+    w->nfree = DUIO_WRITER_DEPTH;
+
+    for (int i = 0; i < DUIO_WRITER_THREADS; i++) {
+        if (pthread_create(&w->tids[i], NULL, duio_writer_worker, w) != 0)
+            break;
+        w->nthreads++;
+    }
+    if (w->nthreads == 0) {
+        free(w->buffers);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+int duio_writer_submit(duio_writer *w, int fd, const void *data, int len, int64_t offset){
+    if (len > w->block)
+        return -1;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->nfree == 0)
+        pthread_cond_wait(&w->idle, &w->lock);
+    if (w->error != 0) {
+        errno = w->error;
+        pthread_mutex_unlock(&w->lock);
+        return -1;
+    }
+    int slot = w->free_slots[--w->nfree];
+    pthread_mutex_unlock(&w->lock);
+
+    //The slot is ours until it is queued, fill it without the lock
+    duio_wreq *req = &w->reqs[slot];
+    req->fd = fd;
+    req->len = len;
+    req->offset = offset;
+    memcpy(req->data, data, len);
+
+    pthread_mutex_lock(&w->lock);
+    w->queue[(w->qhead + w->qcount) % DUIO_WRITER_DEPTH] = slot;
+    w->qcount++;
+    w->inflight++;
+    if (w->sleeping > 0)
+        pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+int duio_writer_drain(duio_writer *w){
+    pthread_mutex_lock(&w->lock);
+    while (w->inflight > 0)
+        pthread_cond_wait(&w->idle, &w->lock);
+    int rc = (w->error != 0) ? -1 : 0;
+    pthread_mutex_unlock(&w->lock);
+    return rc;
+}
+
+void duio_writer_stop(duio_writer *w){
+    if (w == NULL)
+        return;
+    duio_writer_drain(w);
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->work);
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 0; i < w->nthreads; i++)
+        pthread_join(w->tids[i], NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->idle);
+    free(w->buffers);
+    free(w);
+}
+
+void duio_src_prefetch(const duio_src *src, int64_t offset, int64_t len){
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (src->base == NULL || offset >= src->size)
+        return;
+    if (offset + len > src->size)
+        len = src->size - offset;
+    int64_t start = offset / page * page;
+    madvise(src->base + start, len + (offset - start), MADV_WILLNEED);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * du-io: the file I/O engine behind du-ftp.  Sources are memory mapped and
+ * sent straight out of the mapping, destinations are preallocated to their
+ * final size and written with pwrite() at the offset each block carries, so
+ * blocks do not have to arrive in order.
+ */
+typedef struct duio_src {
+    int         fd;
+    char        *base;          //start of the mapping, NULL for an empty file
+    int64_t     size;
+} duio_src;
+
+int  duio_src_open(duio_src *src, const char *path);
+void duio_src_close(duio_src *src);
+
+/*
+ * Zero elision.  duio_src_zeros() returns where the run of zero bytes at
+ * offset ends, in whole blocks (or up to end), and offset itself when there
+ * is data there.  Holes are found with SEEK_HOLE/SEEK_DATA without reading
+ * anything, blocks that are allocated but zero are found by scanning them.
+ * *hole caches where the next hole starts between calls, start it at -1.
+ */
+bool    duio_zero(const void *data, size_t len);
+int64_t duio_src_zeros(const duio_src *src, int64_t offset, int64_t end, int block, int64_t *hole);
+
+/*
+ * Shared source mappings for the server's GET path.  Sessions sending the
+ * same file share one mapping (and so one set of page cache pages) instead
+ * of each mapping it again.  get takes a reference, put drops it.
+ */
+#define DUIO_CACHE_MAX      32      //idle mappings kept around
+
+duio_src *duio_cache_get(const char *path);
+void      duio_cache_put(duio_src *src);
+
+int  duio_dst_open(const char *path, int64_t total_size);
+int  duio_dst_resume(const char *path, int64_t total_size);
+int  duio_dst_write(int fd, const void *data, int len, int64_t offset);
+int  duio_dst_zero(int fd, int64_t offset, int64_t len);
+int  duio_dst_close(int fd, int64_t final_size);
+
+/*
+ * Background writes.  A writer owns DUIO_WRITER_DEPTH buffers and a few
+ * threads that pwrite() them, submit copies the block and returns at once
+ * so the caller can get back to the network while the disk catches up, it
+ * only waits when every buffer is still in flight.  drain waits for all of
+ * them.  A failed write is reported by the next submit or drain.
+ */
+#define DUIO_WRITER_DEPTH   32
+#define DUIO_WRITER_THREADS 2
+
+typedef struct duio_writer duio_writer;
+
+duio_writer *duio_writer_start(int block);
+int  duio_writer_submit(duio_writer *w, int fd, const void *data, int len, int64_t offset);
+int  duio_writer_drain(duio_writer *w);
+void duio_writer_stop(duio_writer *w);
+
+//Starts the kernel reading [offset, offset + len) of the mapping ahead of use
+void duio_src_prefetch(const duio_src *src, int64_t offset, int64_t len);
@@ -0,0 +1,149 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "du-lz.h"
+
+#define DULZ_HASH_BITS      12
+#define DULZ_LAST_LITERALS  5       //a match never runs into the last bytes
+
+static uint32_t dulz_read32(const char *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int dulz_hash(uint32_t v){
+    return (v * 2654435761U) >> (32 - DULZ_HASH_BITS);
+}
+
+//Writes the 255 run that continues a nibble length of 15
+static char *dulz_put_len(char *op, char *end, int len){
+    while (len >= 255) {
+        if (op >= end)
+            return NULL;
+        *op++ = (char)255;
+        len -= 255;
+    }
+    if (op >= end)
+        return NULL;
+    *op++ = (char)len;
+    return op;
+}
+
+static char *dulz_put_seq(char *op, char *end, const char *lit, int lit_len,
+                          int offset, int match_len){
+    int ml = (match_len > 0) ? match_len - DULZ_MIN_MATCH : 0;
+    char *token = op++;
+    if (token >= end)
+        return NULL;
+    *token = (char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15 && (op = dulz_put_len(op, end, lit_len - 15)) == NULL)
+        return NULL;
+    if (op + lit_len > end)
+        return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+        return op;
+    if (op + 2 > end)
+        return NULL;
+    *op++ = (char)(offset & 0xff);
+    *op++ = (char)(offset >> 8);
+    if (ml >= 15 && (op = dulz_put_len(op, end, ml - 15)) == NULL)
+        return NULL;
+    return op;
+}
+
+/*
+ *  Greedy single pass matcher with a hash table of the last position each
+ *  4 byte prefix was seen at.  The output is capped a little under the input
+ *  size, a block that does not fit is not worth compressing.
+ */
+int dulz_compress(const char *src, int len, char *dst, int dst_cap){
+    int table[1 << DULZ_HASH_BITS];
+    const char *ip = src, *anchor = src;
+    const char *match_limit = src + len - DULZ_LAST_LITERALS;
+    char *op = dst;
+    int cap = len - len / 16;
+    char *end = dst + ((cap < dst_cap) ? cap : dst_cap);
+
+    if (len < DULZ_MIN_MATCH + DULZ_LAST_LITERALS + 1)
+        return -1;
+    for (int i = 0; i < (1 << DULZ_HASH_BITS); i++)
+        table[i] = -1;
+
+    while (ip + DULZ_MIN_MATCH <= match_limit) {
+        uint32_t seq = dulz_read32(ip);
+        int h = dulz_hash(seq);
+        int cand = table[h];
+        table[h] = ip - src;
+        if (cand < 0 || (ip - src) - cand > DULZ_MAX_OFFSET ||
+            dulz_read32(src + cand) != seq) {
+            ip++;
+            continue;
+        }
+
+        const char *mp = src + cand + DULZ_MIN_MATCH;
+        const char *mend = ip + DULZ_MIN_MATCH;
+        while (mend < match_limit && *mend == *mp) {
+            mend++;
+            mp++;
+        }
+        op = dulz_put_seq(op, end, anchor, ip - anchor, (ip - src) - cand, mend - ip);
+        if (op == NULL)
+            return -1;
+        ip = mend;
+        anchor = ip;
+    }
+
+    op = dulz_put_seq(op, end, anchor, src + len - anchor, 0, 0);
+    return (op == NULL) ? -1 : op - dst;
+}
+
+static int dulz_get_len(const char **ip, const char *end, int len){
+    unsigned char b;
+    do {
+        if (*ip >= end)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int dulz_decompress(const char *src, int len, char *dst, int dst_cap){
+    const char *ip = src, *end = src + len;
+    char *op = dst, *oend = dst + dst_cap;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+        int lit_len = token >> 4;
+        if (lit_len == 15 && (lit_len = dulz_get_len(&ip, end, lit_len)) < 0)
+            return -1;
+        if (lit_len > end - ip || lit_len > oend - op)
+            return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        int offset = (unsigned char)ip[0] | ((unsigned char)ip[1] << 8);
+        ip += 2;
+        int match_len = token & 15;
+        if (match_len == 15 && (match_len = dulz_get_len(&ip, end, match_len)) < 0)
+            return -1;
+        match_len += DULZ_MIN_MATCH;
+        if (offset == 0 || offset > op - dst || match_len > oend - op)
+            return -1;
+
+        //Byte by byte, a match may overlap the bytes it is producing
+        const char *mp = op - offset;
+        for (int i = 0; i < match_len; i++)
+            op[i] = mp[i];
+        op += match_len;
+    }
+    return op - dst;
+}
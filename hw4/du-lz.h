@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+ * du-lz: a small built in LZ77 block codec for du-ftp, so compression needs
+ * no outside library.  The format follows LZ4's block format: a sequence is
+ * a token (literal run length in the high nibble, match length - 4 in the
+ * low one, 15 meaning more length bytes follow), the literals, a 2 byte
+ * little endian match offset and any extra match length bytes.  The last
+ * sequence is literals only.
+ */
+#define DULZ_MIN_MATCH      4
+#define DULZ_MAX_OFFSET     65535
+
+//Returns the compressed size, or -1 when the block would not come out
+//meaningfully smaller and should be sent raw
+int dulz_compress(const char *src, int len, char *dst, int dst_cap);
+
+//Returns the decompressed size, or -1 for corrupt input or a short dst
+int dulz_decompress(const char *src, int len, char *dst, int dst_cap);
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "du-metrics.h"
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void dumetrics_init(dumetrics *m, const char *label){
+    memset(m, 0, sizeof(dumetrics));
+    m->label = label;
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+    m->start = now_sec();
+    m->last_time = m->start;
+}
+
+//The first of a batch of overlapping sessions starts the numbers from zero
+void dumetrics_session_start(dumetrics *m){
+    pthread_mutex_lock(&m->lock);
+    if (m->sessions++ == 0) {
+        atomic_store_explicit(&m->bytes, 0, memory_order_relaxed);
+        atomic_store_explicit(&m->blocks, 0, memory_order_relaxed);
+        atomic_store_explicit(&m->stalls, 0, memory_order_relaxed);
+        atomic_store_explicit(&m->stall_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&m->total, 0, memory_order_relaxed);
+        m->start = now_sec();
+        m->last_time = m->start;
+        m->last_bytes = 0;
+        m->ewma = 0;
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+void dumetrics_session_end(dumetrics *m){
+    pthread_mutex_lock(&m->lock);
+    m->sessions--;
+    pthread_mutex_unlock(&m->lock);
+}
+
+static void fmt_bytes(char *out, int out_sz, double bytes){
+    if (bytes >= 1024.0 * 1024 * 1024)
+        snprintf(out, out_sz, "%.2f GB", bytes / (1024.0 * 1024 * 1024));
+    else if (bytes >= 1024.0 * 1024)
+        snprintf(out, out_sz, "%.1f MB", bytes / (1024.0 * 1024));
+    else
+        snprintf(out, out_sz, "%.1f KB", bytes / 1024.0);
+}
+
+//Rewrites the export file through a rename so readers never see half of it
+static void export_sample(dumetrics *m, double elapsed, int64_t bytes, int64_t blocks,
+                          int64_t stalls, int64_t stall_ns, int64_t total, double rate){
+    char tmp[sizeof(m->export_path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m->export_path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        return;
+    fprintf(f, "role %s\nelapsed_s %.3f\nbytes %lld\nblocks %lld\ntotal_bytes %lld\n"
+               "stalls %lld\nstall_s %.3f\nrate_avg_bps %.0f\nrate_ewma_bps %.0f\n",
+            m->label, elapsed, (long long)bytes, (long long)blocks, (long long)total,
+            (long long)stalls, stall_ns / 1e9, (elapsed > 0) ? bytes / elapsed : 0.0, rate);
+    if (total > 0 && rate > 0)
+        fprintf(f, "eta_s %.1f\n", (total - bytes) / rate);
+    if (fclose(f) == 0)
+        rename(tmp, m->export_path);
+    else
+        unlink(tmp);
+}
+
+/*
+ *  Takes one sample.  The moving average weighs each sample by how long it
+ *  covers, so it means the same whatever the interval.  Nothing is printed
+ *  while nothing moves, an idle server stays quiet.  Only the reporter thread
+ *  calls this until dumetrics_stop() has joined it, the lock keeps a session
+ *  start from resetting the clock under it
+ */
+void dumetrics_report(dumetrics *m, bool final){
+    char done[32], of[32];
+
+    pthread_mutex_lock(&m->lock);
+    double now = now_sec();
+    int64_t bytes = atomic_load_explicit(&m->bytes, memory_order_relaxed);
+    int64_t blocks = atomic_load_explicit(&m->blocks, memory_order_relaxed);
+    int64_t stalls = atomic_load_explicit(&m->stalls, memory_order_relaxed);
+    int64_t stall_ns = atomic_load_explicit(&m->stall_ns, memory_order_relaxed);
+    int64_t total = atomic_load_explicit(&m->total, memory_order_relaxed);
+    double elapsed = now - m->start;
+
+    double dt = now - m->last_time;
+    if (dt > 0) {
+        double inst = (bytes - m->last_bytes) / dt;
+        double alpha = 1.0 - exp(-dt / DUMETRICS_EWMA_TAU);
+        m->ewma = (m->ewma == 0) ? inst : m->ewma + alpha * (inst - m->ewma);
+    }
+    bool moved = (bytes != m->last_bytes);
+    m->last_time = now;
+    m->last_bytes = bytes;
+
+    if (m->export_path[0] != '\0')
+        export_sample(m, elapsed, bytes, blocks, stalls, stall_ns, total, m->ewma);
+
+    fmt_bytes(done, sizeof(done), bytes);
+    if (final) {
+        printf("[%s] %s in %.2fs, %.2f MB/s, %lld blocks, %lld ACK waits (%.2fs)\n", m->label,
+               done, elapsed, (elapsed > 0) ? bytes / elapsed / 1048576.0 : 0.0,
+               (long long)blocks, (long long)stalls, stall_ns / 1e9);
+    } else if (moved) {
+        if (total > 0) {
+            fmt_bytes(of, sizeof(of), total);
+            printf("[%s] %s of %s (%.1f%%), %.2f MB/s (avg %.2f MB/s)", m->label, done, of,
+                   100.0 * bytes / total, m->ewma / 1048576.0, bytes / elapsed / 1048576.0);
+            if (m->ewma > 0 && total > bytes)
+                printf(", ETA %.0fs", (total - bytes) / m->ewma);
+            printf("\n");
+        } else {
+            printf("[%s] %s, %.2f MB/s (avg %.2f MB/s)\n", m->label, done,
+                   m->ewma / 1048576.0, bytes / elapsed / 1048576.0);
+        }
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&m->lock);
+}
+
+static void *dumetrics_reporter(void *arg){
+    dumetrics *m = arg;
+    struct timespec next;
+
+    clock_gettime(CLOCK_REALTIME, &next);
+    pthread_mutex_lock(&m->lock);
+    while (!m->stop) {
+        next.tv_sec += m->interval_ms / 1000;
+        next.tv_nsec += (long)(m->interval_ms % 1000) * 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        while (!m->stop && pthread_cond_timedwait(&m->cond, &m->lock, &next) != ETIMEDOUT)
+            ;
+        if (m->stop)
+            break;
+        pthread_mutex_unlock(&m->lock);
+        dumetrics_report(m, false);
+        pthread_mutex_lock(&m->lock);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return NULL;
+}
+
+//interval_ms of 0 means no reporter, the final line is still printed
+int dumetrics_start(dumetrics *m, int interval_ms, const char *export_path){
+    m->interval_ms = interval_ms;
+    if (export_path != NULL)
+        snprintf(m->export_path, sizeof(m->export_path), "%s", export_path);
+    if (interval_ms <= 0)
+        return 0;
+    if (pthread_create(&m->tid, NULL, dumetrics_reporter, m) != 0)
+        return -1;
+    m->running = true;
+    return 0;
+}
+
+//Stops the reporter and prints the summary for the whole run
+void dumetrics_stop(dumetrics *m){
+    if (m->running) {
+        pthread_mutex_lock(&m->lock);
+        m->stop = true;
+        pthread_cond_signal(&m->cond);
+        pthread_mutex_unlock(&m->lock);
+        pthread_join(m->tid, NULL);
+        m->running = false;
+    }
+    dumetrics_report(m, true);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * du-metrics: transfer progress without a printf per block.  The data path
+ * only bumps relaxed atomic counters, a reporter thread samples them every
+ * interval and prints one progress line (throughput, a moving average rate
+ * and an ETA when the total is known).  The same numbers can be exported to
+ * a file that is rewritten atomically at every sample, for monitoring.
+ * A server restarts the clock and the counters when a session starts with
+ * none running, so rates cover the sessions and not the idle time between.
+ */
+#define DUMETRICS_DEF_INTERVAL_MS   1000
+#define DUMETRICS_EWMA_TAU          5.0     //seconds, time constant of the average
+
+typedef struct dumetrics {
+    _Atomic int64_t bytes;          //payload bytes moved, before compression
+    _Atomic int64_t blocks;
+    _Atomic int64_t stalls;         //waits for the peer's ACK
+    _Atomic int64_t stall_ns;       //time spent in them
+    _Atomic int64_t total;          //bytes expected, 0 = unknown
+    const char      *label;
+    int             interval_ms;
+    char            export_path[256];
+    pthread_t       tid;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    bool            running;
+    bool            stop;
+    int             sessions;       //running, under lock
+    double          start;          //seconds, CLOCK_MONOTONIC
+    double          ewma;           //bytes per second
+    double          last_time;      //previous sample
+    int64_t         last_bytes;
+} dumetrics;
+
+void dumetrics_init(dumetrics *m, const char *label);
+int  dumetrics_start(dumetrics *m, int interval_ms, const char *export_path);
+void dumetrics_stop(dumetrics *m);
+void dumetrics_report(dumetrics *m, bool final);
+void dumetrics_session_start(dumetrics *m);
+void dumetrics_session_end(dumetrics *m);
+
+static inline void dumetrics_add(dumetrics *m, int64_t bytes){
+    atomic_fetch_add_explicit(&m->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->blocks, 1, memory_order_relaxed);
+}
+
+static inline void dumetrics_stall(dumetrics *m, int64_t ns){
+    atomic_fetch_add_explicit(&m->stalls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->stall_ns, ns, memory_order_relaxed);
+}
+
+//Adds to the bytes expected, a new file or stripe announces its size
+static inline void dumetrics_expect(dumetrics *m, int64_t bytes){
+    atomic_fetch_add_explicit(&m->total, bytes, memory_order_relaxed);
+}
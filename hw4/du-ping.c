@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "du-proto.h"
+
+/*
+ *  du-ping is a tiny request/response benchmark for du-proto.  The client
+ *  sends a small message, the server echos it back, and the client records
+ *  the round trip time of every exchange.  It is used to measure the effect
+ *  of the low latency (busy poll) mode on small message RPC style traffic.
+ */
+#define PING_DEF_PORT       2081
+#define PING_DEF_COUNT      1000
+#define PING_DEF_MSG_SZ     256
+#define PING_DEF_SVR_ADDR   "127.0.0.1"
+
+typedef struct ping_config{
+    bool    is_server;
+    int     port_number;
+    char    svr_ip_addr[16];
+    int     count;
+    int     msg_sz;
+    int     spin_usec;
+    int     cpu;
+} ping_config;
+
+static char msg_buff[DP_MAX_BUFF_SZ];
+
+static void initParams(int argc, char *argv[], ping_config *cfg){
+    int option;
+
+    cfg->is_server = false;
+    cfg->port_number = PING_DEF_PORT;
+    strcpy(cfg->svr_ip_addr, PING_DEF_SVR_ADDR);
+    cfg->count = PING_DEF_COUNT;
+    cfg->msg_sz = PING_DEF_MSG_SZ;
+    cfg->spin_usec = 0;
+    cfg->cpu = -1;
+
+    while ((option = getopt(argc, argv, ":p:a:n:z:b:k:csh")) != -1){
+        switch(option) {
+            case 'p':
+                cfg->port_number = atoi(optarg);
+                break;
+            case 'a':
+                strncpy(cfg->svr_ip_addr, optarg, sizeof(cfg->svr_ip_addr) - 1);
+                break;
+            case 'n':
+                cfg->count = atoi(optarg);
+                break;
+            case 'z':
+                cfg->msg_sz = atoi(optarg);
+                if (cfg->msg_sz < 1 || cfg->msg_sz > DP_MAX_BUFF_SZ) {
+                    fprintf(stderr, "Message size must be between 1 and %d\n", DP_MAX_BUFF_SZ);
+                    exit(-1);
+                }
+                break;
+            case 'b':
+                cfg->spin_usec = atoi(optarg);
+                break;
+            case 'k':
+                cfg->cpu = atoi(optarg);
+                break;
+            case 'c':
+                cfg->is_server = false;
+                break;
+            case 's':
+                cfg->is_server = true;
+                break;
+            case 'h':
+                printf("USAGE: %s [-p port] [-a svr_addr] [-n count] [-z msg_sz] [-b spin_usec] [-k cpu] [-s] [-c] [-h]\n", argv[0]);
+                printf("WHERE:\n\t[-c] runs in client mode, [-s] runs in server mode; DEFAULT= client_mode\n");
+                printf("\t[-n count] number of round trips to measure; DEFAULT = %d\n", cfg->count);
+                printf("\t[-z msg_sz] bytes per message; DEFAULT = %d\n", cfg->msg_sz);
+                printf("\t[-b spin_usec] enables low latency mode, busy polling this long before blocking\n");
+                printf("\t[-k cpu] pins the low latency thread to this cpu\n\n");
+                exit(0);
+            case ':':
+                perror ("Option missing value");
+                exit(-1);
+            default:
+            case '?':
+                perror ("Unknown option");
+                exit(-1);
+        }
+    }
+}
+
+static int cmp_long(const void *a, const void *b){
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static long elapsed_ns(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ *  Runs count round trips and fills p50/p99 (in microseconds)
+ */
+static int run_round(dp_connp dpc, ping_config *cfg, long *rtt, double *p50, double *p99){
+    struct timespec start, end;
+
+    for (int i = 0; i < cfg->count; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (dpsend(dpc, msg_buff, cfg->msg_sz) < 0)
+            return -1;
+        if (dprecv(dpc, msg_buff, cfg->msg_sz) < 0)
+            return -1;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        rtt[i] = elapsed_ns(&start, &end);
+    }
+
+    qsort(rtt, cfg->count, sizeof(long), cmp_long);
+    *p50 = rtt[cfg->count / 2] / 1000.0;
+    *p99 = rtt[(cfg->count * 99) / 100] / 1000.0;
+    return 0;
+}
+
+static void start_client(dp_connp dpc, ping_config *cfg){
+    double base_p50, base_p99, ll_p50, ll_p99;
+    long *rtt = malloc(cfg->count * sizeof(long));
+
+    memset(msg_buff, 'x', sizeof(msg_buff));
+
+    if (run_round(dpc, cfg, rtt, &base_p50, &base_p99) < 0) {
+        printf("ERROR: blocking round failed\n");
+        free(rtt);
+        return;
+    }
+    printf("blocking     : %d x %d bytes  p50 %8.1f us  p99 %8.1f us\n",
+           cfg->count, cfg->msg_sz, base_p50, base_p99);
+
+    if (cfg->spin_usec > 0) {
+        dpsetlowlatency(dpc, cfg->spin_usec, cfg->cpu);
+        if (run_round(dpc, cfg, rtt, &ll_p50, &ll_p99) < 0) {
+            printf("ERROR: low latency round failed\n");
+            free(rtt);
+            return;
+        }
+        printf("low latency  : %d x %d bytes  p50 %8.1f us  p99 %8.1f us\n",
+               cfg->count, cfg->msg_sz, ll_p50, ll_p99);
+        printf("improvement  : p50 %.1f%%  p99 %.1f%%\n",
+               100.0 * (base_p50 - ll_p50) / base_p50,
+               100.0 * (base_p99 - ll_p99) / base_p99);
+    }
+
+    free(rtt);
+    dpdisconnect(dpc);
+}
+
+static void start_server(dp_connp dpc, ping_config *cfg){
+    int rcvSz;
+
+    if (cfg->spin_usec > 0)
+        dpsetlowlatency(dpc, cfg->spin_usec, cfg->cpu);
+
+    while ((rcvSz = dprecv(dpc, msg_buff, sizeof(msg_buff))) >= 0) {
+        if (dpsend(dpc, msg_buff, rcvSz) < 0)
+            break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    ping_config cfg;
+    dp_connp dpc;
+
+    initParams(argc, argv, &cfg);
+    dpdebug(false);
+
+    if (cfg.is_server) {
+        dpc = dpServerInit(cfg.port_number);
+        if (dpc == NULL || dplisten(dpc) < 0) {
+            perror("Error establishing connection");
+            exit(-1);
+        }
+        start_server(dpc, &cfg);
+        dpclose(dpc);
+    } else {
+        dpc = dpClientInit(cfg.svr_ip_addr, cfg.port_number);
+        if (dpc == NULL || dpconnect(dpc) < 0) {
+            perror("Error establishing connection");
+            exit(-1);
+        }
+        start_client(dpc, &cfg);
+    }
+    return 0;
+}
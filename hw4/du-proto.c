@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h> 
 #include <stdlib.h>
 #include <string.h>
@@ -5,15 +6,24 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "du-proto.h"
 
-static char _dpBuffer[DP_MAX_DGRAM_SZ];
 static int  _debugMode = 1;
 
+static pthread_mutex_t _totalsLock = PTHREAD_MUTEX_INITIALIZER;
+static dp_stats _totals;
+
 static dp_connp dpinit(){
     dp_connp dpsession = malloc(sizeof(dp_connection));
+    if (dpsession == NULL)
+        return NULL;
     bzero(dpsession, sizeof(dp_connection));
     dpsession->outSockAddr.isAddrInit = false;
     dpsession->inSockAddr.isAddrInit = false;
@@ -22,19 +32,144 @@ static dp_connp dpinit(){
     dpsession->seqNum = 0;
     dpsession->isConnected = false;
     dpsession->dbgMode = true;
+    dpsession->window = DP_DEF_WINDOW;
+    if (dppool_init(&dpsession->pool, dpsession->window) < 0) {
+        free(dpsession);
+        return NULL;
+    }
     return dpsession;
 }
 
-void dpclose(dp_connp dpsession) {
+//Undoes dpinit(), the socket is the caller's to close
+static void dpfree(dp_connp dpsession){
+    dppool_free(&dpsession->pool);
     free(dpsession);
 }
 
+void dpclose(dp_connp dpsession) {
+    dp_stats *s = &dpsession->stats;
+    pthread_mutex_lock(&_totalsLock);
+    _totals.msgsSent   += s->msgsSent;
+    _totals.msgsRcvd   += s->msgsRcvd;
+    _totals.dgramsSent += s->dgramsSent;
+    _totals.dgramsRcvd += s->dgramsRcvd;
+    _totals.bytesSent  += s->bytesSent;
+    _totals.bytesRcvd  += s->bytesRcvd;
+    _totals.syscalls   += s->syscalls;
+    pthread_mutex_unlock(&_totalsLock);
+
+    close(dpsession->udp_sock);
+    dpfree(dpsession);
+}
+
+/*
+ *  Sets how many datagrams dpsend() may have outstanding before it has to wait
+ *  for an ACK.  The receiver ACKs every datagram no matter what, so this is a
+ *  sender side setting only.  The segment pool is resized to the window here,
+ *  once, so that the send path itself never allocates.
+ */
+int dpsetwindow(dp_connp dp, int window) {
+    if (window < 1 || window > DP_MAX_WINDOW)
+        return DP_ERROR_GENERAL;
+
+    int rc = dpflush(dp);
+    if (rc < 0)
+        return rc;
+
+    dppool_free(&dp->pool);
+    if (dppool_init(&dp->pool, window) < 0)
+        return DP_ERROR_GENERAL;
+    dp->window = window;
+    return DP_NO_ERROR;
+}
+
+/*
+ *  Opt in low latency mode for small request/response traffic.  Receives spin
+ *  on non-blocking recvfrom() for up to spinUsec microseconds before falling
+ *  back to a blocking wait, SO_BUSY_POLL asks the driver to poll the device
+ *  queue as well, and the calling thread is pinned to cpu so the spinning
+ *  thread keeps a warm cache.  Pass cpu < 0 to leave affinity alone and
+ *  spinUsec = 0 to turn the mode off again.
+ */
+int dpsetlowlatency(dp_connp dp, int spinUsec, int cpu) {
+    if (spinUsec < 0)
+        return DP_ERROR_GENERAL;
+
+    dp->spinUsec = spinUsec;
+    if (spinUsec == 0)
+        return DP_NO_ERROR;
+
+    //Raising SO_BUSY_POLL may need CAP_NET_ADMIN, the spin loop works without it
+    if (setsockopt(dp->udp_sock, SOL_SOCKET, SO_BUSY_POLL, &spinUsec, sizeof(spinUsec)) < 0)
+        perror("setsockopt(SO_BUSY_POLL) failed, spinning in user space only");
+
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+            perror("sched_setaffinity failed");
+    }
+    return DP_NO_ERROR;
+}
+
+/*
+ *  Bounds how long a receive may block, 0 waits forever (the default).  A
+ *  server uses this so a client that vanished mid session shows up as
+ *  DP_ERROR_TIMEOUT instead of a receive that never returns.
+ */
+int dpsettimeout(dp_connp dp, int seconds) {
+    struct timeval tv = { .tv_sec = seconds, .tv_usec = 0 };
+    if (setsockopt(dp->udp_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("setsockopt(SO_RCVTIMEO) failed");
+        return DP_ERROR_GENERAL;
+    }
+    return DP_NO_ERROR;
+}
+
+//Counts of every connection closed so far
+void dptotals(dp_stats *totals) {
+    pthread_mutex_lock(&_totalsLock);
+    *totals = _totals;
+    pthread_mutex_unlock(&_totalsLock);
+}
+
+//What a connection did between two snapshots of its stats
+void dpstats_diff(dp_stats *out, const dp_stats *now, const dp_stats *before) {
+    out->msgsSent   = now->msgsSent   - before->msgsSent;
+    out->msgsRcvd   = now->msgsRcvd   - before->msgsRcvd;
+    out->dgramsSent = now->dgramsSent - before->dgramsSent;
+    out->dgramsRcvd = now->dgramsRcvd - before->dgramsRcvd;
+    out->bytesSent  = now->bytesSent  - before->bytesSent;
+    out->bytesRcvd  = now->bytesRcvd  - before->bytesRcvd;
+    out->syscalls   = now->syscalls   - before->syscalls;
+}
+
+void dpdebug(int on) {
+    _debugMode = on ? 1 : 0;
+}
+
 int  dpmaxdgram(){
     return DP_MAX_BUFF_SZ;
 }
 
 
 dp_connp dpServerInit(int port) {
+    return dpServerSetup(port, false);
+}
+
+/*
+ *  Same as dpServerInit() but the socket is opened with SO_REUSEPORT so that
+ *  several sockets (typically one per worker thread/core) can bind the same
+ *  port.  The kernel then shards inbound datagrams across the sockets by
+ *  hashing the sender address, so a given client always lands on the same
+ *  socket and each worker can run its own connection with no shared state.
+ */
+dp_connp dpServerInitShared(int port) {
+    return dpServerSetup(port, true);
+}
+
+static dp_connp dpServerSetup(int port, _Bool reusePort) {
     struct sockaddr_in *servaddr;
     int *sock;
     int rc;
@@ -52,6 +187,7 @@ dp_connp dpServerInit(int port) {
     // Creating socket file descriptor 
     if ( (*sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) { 
         perror("socket creation failed"); 
+        dpfree(dpc);
         return NULL;
     } 
 
@@ -61,14 +197,17 @@ dp_connp dpServerInit(int port) {
     servaddr->sin_port = htons(port); 
 
     // Set socket options so that we dont have to wait for ports held by OS
-    // if (setsockopt(*sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0){
-    //     perror("setsockopt(SO_REUSEADDR) failed");
-    //     close(*sock);
-    //     return NULL;
-    // }
+    if (reusePort &&
+        setsockopt(*sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0){
+        perror("setsockopt(SO_REUSEPORT) failed");
+        close(*sock);
+        dpfree(dpc);
+        return NULL;
+    }
     if (setsockopt(*sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0){
         perror("setsockopt(SO_REUSEADDR) failed");
         close(*sock);
+        dpfree(dpc);
         return NULL;
     }
     if ( (rc = bind(*sock, (const struct sockaddr *)servaddr,  
@@ -76,6 +215,7 @@ dp_connp dpServerInit(int port) {
     { 
         perror("bind failed"); 
         close (*sock);
+        dpfree(dpc);
         return NULL;
     } 
 
@@ -101,6 +241,7 @@ dp_connp dpClientInit(char *addr, int port) {
     // Creating socket file descriptor 
     if ( (*sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) { 
         perror("socket creation failed"); 
+        dpfree(dpc);
         return NULL;
     } 
 
@@ -118,35 +259,40 @@ dp_connp dpClientInit(char *addr, int port) {
 }
 
 int dprecv(dp_connp dp, void *buff, int buff_sz) {
-    if(buff_sz <= dpmaxdgram()) {
-        return dprecvdgram(dp, _dpBuffer, sizeof(_dpBuffer));
-    }
-    
+    //The line is turning around, collect the ACKs for whatever we still have
+    //in flight first so they are not mistaken for data
+    int rc = dpflush(dp);
+    if (rc < 0)
+        return rc;
+
+    //Messages larger than a datagram arrive as a run of DP_MT_FRAGMENT
+    //datagrams closed off by a regular one, reassemble until we see it
     int totalReceived = 0;
     char *currentPos = (char *)buff;
     int remaining = buff_sz;
     
-    while(remaining > 0) {
-        int rcvLen = dprecvdgram(dp, _dpBuffer, sizeof(_dpBuffer));
-        
-        if(rcvLen == DP_CONNECTION_CLOSED)
-            return (totalReceived > 0) ? totalReceived : DP_CONNECTION_CLOSED;
+    while(1) {
+        int rcvLen = dprecvdgram(dp, dp->dgramBuff, sizeof(dp->dgramBuff));
         
+        //A message cut off part way is no use to the caller, report why
         if(rcvLen < 0)
-            return (totalReceived > 0) ? totalReceived : rcvLen;
-        dp_pdu *inPdu = (dp_pdu *)_dpBuffer;
+            return rcvLen;
+        dp_pdu *inPdu = (dp_pdu *)dp->dgramBuff;
         int dataSize = inPdu->dgram_sz;
         
         if(rcvLen > sizeof(dp_pdu) && dataSize > 0) {
             int copySize = (dataSize <= remaining) ? dataSize : remaining;
-            memcpy(currentPos, (_dpBuffer + sizeof(dp_pdu)), copySize);
+            if (copySize < dataSize)
+                printf("Warning: dprecv buffer too small, message truncated\n");
+            memcpy(currentPos, (dp->dgramBuff + sizeof(dp_pdu)), copySize);
             totalReceived += copySize;
             currentPos += copySize;
             remaining -= copySize;
         }
-        if(dataSize == 0 || remaining == 0)
+        if(!(inPdu->mtype & DP_MT_FRAGMENT))
             break;
     }
+    dp->stats.msgsRcvd++;
     
     return totalReceived;
 }
@@ -160,6 +306,8 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
         return DP_BUFF_OVERSIZED;
 
     bytesIn = dprecvraw(dp, buff, buff_sz);
+    if (bytesIn < 0)
+        return bytesIn;
 
     //check for some sort of error and just return it
     if (bytesIn < sizeof(dp_pdu))
@@ -171,7 +319,7 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
         errCode = DP_BUFF_UNDERSIZED;
 
     //Copy buffer back
-    // memcpy(buff, (_dpBuffer+sizeof(dp_pdu)), inPdu.dgram_sz);
+    // memcpy(buff, (dp->dgramBuff+sizeof(dp_pdu)), inPdu.dgram_sz);
     
     
     //UDPATE SEQ NUMBER AND PREPARE ACK
@@ -203,7 +351,7 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
     }
 
 
-    switch(inPdu.mtype){
+    switch(inPdu.mtype & ~DP_MT_FRAGMENT){
         case DP_MT_SND:
             outPdu.mtype = DP_MT_SNDACK;
             actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
@@ -215,7 +363,8 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
             actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
             if (actSndSz != sizeof(dp_pdu))
                 return DP_ERROR_PROTOCOL;
-            dpclose(dp);
+            //Keep the socket, a server goes back to dplisten() on it
+            dp->isConnected = false;
             return DP_CONNECTION_CLOSED;
         default:
         {
@@ -236,15 +385,40 @@ static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
         return -1;
     }
 
-    bytes = recvfrom(dp->udp_sock, (char *)buff, buff_sz,  
-                MSG_WAITALL, ( struct sockaddr *) &(dp->outSockAddr.addr), 
-                &(dp->outSockAddr.len)); 
+    struct sockaddr_in fromAddr;
+    socklen_t fromLen;
+    while(1) {
+        fromLen = sizeof(fromAddr);
+        bytes = dprecvfrom(dp, buff, buff_sz, &fromAddr, &fromLen);
+
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                printf("dprecv: timed out waiting for the peer\n");
+                return DP_ERROR_TIMEOUT;
+            }
+            perror("dprecv: received error from recvfrom()");
+            return -1;
+        }
 
-    if (bytes < 0) {
-        perror("dprecv: received error from recvfrom()");
-        return -1;
+        //While connected, only the peer may talk to us.  A shared server socket
+        //can still see datagrams from other clients, park their CONNECTs so
+        //later dplisten() calls pick them up and drop anything else
+        if (!dp->isConnected || dpsameaddr(&fromAddr, &dp->outSockAddr.addr))
+            break;
+        if (bytes == sizeof(dp_pdu) && dp->pendingCount < DP_CONNECT_BACKLOG &&
+            ((dp_pdu *)buff)->mtype == DP_MT_CONNECT) {
+            memcpy(&dp->pendingConnect[dp->pendingCount], buff, sizeof(dp_pdu));
+            memcpy(&dp->pendingAddr[dp->pendingCount], &fromAddr, sizeof(fromAddr));
+            dp->pendingCount++;
+        } else if (_debugMode == 1) {
+            printf("dprecv: dropping datagram from a peer that is not connected\n");
+        }
     }
+    memcpy(&dp->outSockAddr.addr, &fromAddr, sizeof(fromAddr));
+    dp->outSockAddr.len = fromLen;
     dp->outSockAddr.isAddrInit = true;
+    dp->stats.dgramsRcvd++;
+    dp->stats.bytesRcvd += bytes;
 
     //some helper code if you want to do debugging
     if (bytes > sizeof(dp_pdu)){
@@ -262,23 +436,63 @@ static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
     return bytes;
 }
 
-int dpsend(dp_connp dp, void *sbuff, int sbuff_sz) {
-    // If data is too large to send in one go, break it into multiple sends
-    if(sbuff_sz <= dpmaxdgram()) {
-        return dpsenddgram(dp, sbuff, sbuff_sz);
+/*
+ *  The actual socket read.  In low latency mode spin on non-blocking reads
+ *  for the configured budget first, the wakeup from a blocking recvfrom()
+ *  costs more than a small request/response round trip.
+ */
+static int dprecvfrom(dp_connp dp, void *buff, int buff_sz,
+                      struct sockaddr_in *from, socklen_t *fromLen){
+    if (dp->spinUsec > 0) {
+        struct timespec now, end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        end.tv_nsec += (long)dp->spinUsec * 1000;
+        end.tv_sec  += end.tv_nsec / 1000000000;
+        end.tv_nsec %= 1000000000;
+        do {
+            dp->stats.syscalls++;
+            int bytes = recvfrom(dp->udp_sock, (char *)buff, buff_sz, MSG_DONTWAIT,
+                                 (struct sockaddr *)from, fromLen);
+            if (bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                return bytes;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while (now.tv_sec < end.tv_sec ||
+                 (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
     }
-    
-    // For larger data, send in chunks
+
+    dp->stats.syscalls++;
+    return recvfrom(dp->udp_sock, (char *)buff, buff_sz,  
+                MSG_WAITALL, (struct sockaddr *)from, fromLen); 
+}
+
+int dpsend(dp_connp dp, void *sbuff, int sbuff_sz) {
+    struct iovec iov = { .iov_base = sbuff, .iov_len = sbuff_sz };
+    return dpsendv(dp, &iov, 1);
+}
+
+/*
+ *  Gather version of dpsend(), the message is the concatenation of the iov
+ *  pieces.  Each piece is copied straight into the outgoing segments so the
+ *  caller never has to assemble the message in a buffer of its own (e.g. a
+ *  header followed by data that lives in a file mapping).
+ */
+int dpsendv(dp_connp dp, const struct iovec *iov, int iovcnt) {
+    dp_iovcursor cursor = { .iov = iov, .iovcnt = iovcnt, .idx = 0, .off = 0 };
+    int remaining = 0;
+    for (int i = 0; i < iovcnt; i++)
+        remaining += iov[i].iov_len;
+
+    // If data is too large to send in one go, break it into multiple sends,
+    // every chunk but the last is marked as a fragment so the receiver knows
+    // where the message ends
     int totalSent = 0;
-    int remaining = sbuff_sz;
-    char *currentPos = (char *)sbuff;
     
-    while(remaining > 0) {
+    do {
         // Determine size of this chunk
         int chunkSize = (remaining > dpmaxdgram()) ? dpmaxdgram() : remaining;
         
         // Send this chunk
-        int sent = dpsenddgram(dp, currentPos, chunkSize);
+        int sent = dpsenddgram(dp, &cursor, chunkSize, chunkSize < remaining);
         if(sent < 0) {
             return (totalSent > 0) ? totalSent : sent;
         }
@@ -286,13 +500,13 @@ int dpsend(dp_connp dp, void *sbuff, int sbuff_sz) {
         // Update counters and position
         totalSent += sent;
         remaining -= sent;
-        currentPos += sent;
-    }
+    } while(remaining > 0);
+    dp->stats.msgsSent++;
     
     return totalSent;
 }
 
-static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz){
+static int dpsenddgram(dp_connp dp, dp_iovcursor *src, int sbuff_sz, _Bool isFragment){
     int bytesOut = 0;
 
     if(!dp->outSockAddr.isAddrInit) {
@@ -303,18 +517,42 @@ static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz){
     if(sbuff_sz > DP_MAX_BUFF_SZ)
         return DP_ERROR_GENERAL;
 
-    //Build the PDU and out buffer
-    dp_pdu *outPdu = (dp_pdu *)_dpBuffer;
+    //The window is full when the pool runs dry, wait for the oldest ACK
+    dp_segment *seg;
+    while ((seg = dppool_get(&dp->pool)) == NULL) {
+        if (dpwaitack(dp) < 0)
+            return DP_ERROR_PROTOCOL;
+    }
+
+    //Build the PDU and out buffer directly in the segment
+    dp_pdu *outPdu = (dp_pdu *)seg->dgram;
     int    sndSz = sbuff_sz;
     outPdu->proto_ver = DP_PROTO_VER_1;
-    outPdu->mtype = DP_MT_SND;
+    outPdu->mtype = isFragment ? (DP_MT_SND | DP_MT_FRAGMENT) : DP_MT_SND;
     outPdu->dgram_sz = sndSz;
     outPdu->seqnum = dp->seqNum;
-
-    memcpy((_dpBuffer + sizeof(dp_pdu)), sbuff, sndSz);
+    outPdu->err_num = DP_NO_ERROR;
+
+    //gather the payload from the caller's pieces
+    char *dst = seg->dgram + sizeof(dp_pdu);
+    int need = sndSz;
+    while (need > 0) {
+        const struct iovec *piece = &src->iov[src->idx];
+        int avail = piece->iov_len - src->off;
+        int take = (avail < need) ? avail : need;
+        memcpy(dst, (char *)piece->iov_base + src->off, take);
+        dst += take;
+        need -= take;
+        src->off += take;
+        if (src->off == piece->iov_len) {
+            src->idx++;
+            src->off = 0;
+        }
+    }
 
     int totalSendSz = outPdu->dgram_sz + sizeof(dp_pdu);
-    bytesOut = dpsendraw(dp, _dpBuffer, totalSendSz);
+    seg->len = totalSendSz;
+    bytesOut = dpsendraw(dp, seg->dgram, totalSendSz);
 
     if(bytesOut != totalSendSz){
         printf("Warning send %d, but expected %d!\n", bytesOut, totalSendSz);
@@ -326,14 +564,60 @@ static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz){
     else
         dp->seqNum += outPdu->dgram_sz;
 
-    //need to get an ack
+    //keep the segment on the retransmit queue until it is ACK'd
+    seg->next = NULL;
+    if (dp->inFlightTail != NULL)
+        dp->inFlightTail->next = seg;
+    else
+        dp->inFlightHead = seg;
+    dp->inFlightTail = seg;
+    dp->inFlight++;
+
+    //stop and wait (window of 1) gets its ACK right away, like it always did
+    if (dp->inFlight >= dp->window) {
+        if (dpwaitack(dp) < 0)
+            return DP_ERROR_PROTOCOL;
+    }
+
+    return bytesOut - sizeof(dp_pdu);
+}
+
+/*
+ *  Receives one ACK and retires the oldest in flight segment back to the pool.
+ */
+static int dpwaitack(dp_connp dp){
+    dp_segment *seg = dp->inFlightHead;
+    if (seg == NULL)
+        return DP_NO_ERROR;
+
     dp_pdu inPdu = {0};
     int bytesIn = dprecvraw(dp, &inPdu, sizeof(dp_pdu));
-    if ((bytesIn < sizeof(dp_pdu)) && (inPdu.mtype != DP_MT_SNDACK)){
+    if (bytesIn < 0)
+        return DP_ERROR_GENERAL;
+    //Anything but an ACK leaves the segment unacknowledged, so it stays queued
+    if ((bytesIn < sizeof(dp_pdu)) || (inPdu.mtype != DP_MT_SNDACK)){
         printf("Expected SND/ACK but got a different mtype %d\n", inPdu.mtype);
+        return DP_ERROR_PROTOCOL;
     }
 
-    return bytesOut - sizeof(dp_pdu);
+    dp->inFlightHead = seg->next;
+    if (dp->inFlightHead == NULL)
+        dp->inFlightTail = NULL;
+    dp->inFlight--;
+    dppool_put(&dp->pool, seg);
+
+    return DP_NO_ERROR;
+}
+
+/*
+ *  Waits until every datagram sent so far has been ACK'd.
+ */
+int dpflush(dp_connp dp){
+    while (dp->inFlight > 0) {
+        if (dpwaitack(dp) < 0)
+            return DP_ERROR_PROTOCOL;
+    }
+    return DP_NO_ERROR;
 }
 
 
@@ -350,7 +634,11 @@ static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
     bytesOut = sendto(dp->udp_sock, (const char *)sbuff, sbuff_sz, 
         0, (const struct sockaddr *) &(dp->outSockAddr.addr), 
             dp->outSockAddr.len); 
-
+    dp->stats.syscalls++;
+    if (bytesOut > 0) {
+        dp->stats.dgramsSent++;
+        dp->stats.bytesSent += bytesOut;
+    }
     
     print_out_pdu(outPdu);
 
@@ -358,8 +646,39 @@ static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
 }
 
 
+/*
+ *  Takes the next CONNECT off a server connection, either one that knocked
+ *  while we were busy with an earlier session or a fresh one off the wire.
+ *  outSockAddr is left pointing at the client.
+ */
+static int dpnextconnect(dp_connp dp, dp_pdu *pdu) {
+    int rcvSz;
+
+    if (dp->pendingCount > 0) {
+        //A client knocked while we were busy with the previous session, take
+        //the oldest one first
+        memcpy(pdu, &dp->pendingConnect[0], sizeof(dp_pdu));
+        memcpy(&dp->outSockAddr.addr, &dp->pendingAddr[0], sizeof(struct sockaddr_in));
+        dp->outSockAddr.len = sizeof(struct sockaddr_in);
+        dp->outSockAddr.isAddrInit = true;
+        dp->pendingCount--;
+        memmove(&dp->pendingConnect[0], &dp->pendingConnect[1], dp->pendingCount * sizeof(dp_pdu));
+        memmove(&dp->pendingAddr[0], &dp->pendingAddr[1], dp->pendingCount * sizeof(struct sockaddr_in));
+        print_in_pdu(pdu);
+        return 0;
+    }
+
+    printf("Waiting for a connection...\n");
+    rcvSz = dprecvraw(dp, pdu, sizeof(dp_pdu));
+    if (rcvSz != sizeof(dp_pdu)) {
+        perror("dplisten:The wrong number of bytes were received");
+        return DP_ERROR_GENERAL;
+    }
+    return 0;
+}
+
 int dplisten(dp_connp dp) {
-    int sndSz, rcvSz;
+    int sndSz;
 
     if(!dp->inSockAddr.isAddrInit) {
         perror("dplisten:dp connection not setup properly - cli struct not init");
@@ -368,12 +687,18 @@ int dplisten(dp_connp dp) {
 
     dp_pdu pdu = {0};
 
-    printf("Waiting for a connection...\n");
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(pdu)) {
-        perror("dplisten:The wrong number of bytes were received");
-        return DP_ERROR_GENERAL;
+    //Anything still in flight belongs to the previous session
+    dp->isConnected = false;
+    while (dp->inFlightHead != NULL) {
+        dp_segment *seg = dp->inFlightHead;
+        dp->inFlightHead = seg->next;
+        dppool_put(&dp->pool, seg);
     }
+    dp->inFlightTail = NULL;
+    dp->inFlight = 0;
+
+    if (dpnextconnect(dp, &pdu) < 0)
+        return DP_ERROR_GENERAL;
 
     pdu.mtype = DP_MT_CNTACK;
     dp->seqNum = pdu.seqnum + 1;
@@ -392,6 +717,68 @@ int dplisten(dp_connp dp) {
     return true;
 }
 
+/*
+ *  Accepts a client on a listening connection and hands back a brand new
+ *  connection for it, TFTP style.  The new connection gets its own socket on
+ *  an ephemeral port, connect()ed to the client, and answers the CONNECT from
+ *  there.  dpconnect() takes the server address from the CNTACK it receives,
+ *  so the client follows the session to its new port on its own and the
+ *  listening socket only ever sees CONNECTs.  Many sessions can then run at
+ *  once, each on its own thread, without sharing any protocol state.
+ */
+dp_connp dpaccept(dp_connp listener) {
+    dp_pdu pdu = {0};
+    int sock;
+
+    if(!listener->inSockAddr.isAddrInit) {
+        perror("dpaccept:dp connection not setup properly - cli struct not init");
+        return NULL;
+    }
+
+    do {
+        if (dpnextconnect(listener, &pdu) < 0)
+            return NULL;
+    } while (pdu.mtype != DP_MT_CONNECT);
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("dpaccept:socket creation failed");
+        return NULL;
+    }
+    struct sockaddr_in local = {0};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = INADDR_ANY;
+    local.sin_port = 0;
+    if (bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        connect(sock, (struct sockaddr *)&listener->outSockAddr.addr,
+                sizeof(struct sockaddr_in)) < 0) {
+        perror("dpaccept:session socket setup failed");
+        close(sock);
+        return NULL;
+    }
+
+    dp_connp dpc = dpinit();
+    if (dpc == NULL) {
+        close(sock);
+        return NULL;
+    }
+    dpc->udp_sock = sock;
+    dpc->inSockAddr.isAddrInit = true;
+    memcpy(&dpc->outSockAddr, &listener->outSockAddr, sizeof(struct dp_sock));
+    dpsetwindow(dpc, listener->window);
+
+    pdu.mtype = DP_MT_CNTACK;
+    dpc->seqNum = pdu.seqnum + 1;
+    pdu.seqnum = dpc->seqNum;
+    if (dpsendraw(dpc, &pdu, sizeof(pdu)) != sizeof(pdu)) {
+        perror("dpaccept:The wrong number of bytes were sent");
+        dpclose(dpc);
+        return NULL;
+    }
+    dpc->isConnected = true;
+    printf("Connection established OK!\n");
+    return dpc;
+}
+
 int dpconnect(dp_connp dp) {
 
     int sndSz, rcvSz;
@@ -434,6 +821,9 @@ int dpdisconnect(dp_connp dp) {
 
     int sndSz, rcvSz;
 
+    if (dpflush(dp) < 0)
+        return DP_ERROR_PROTOCOL;
+
     dp_pdu pdu = {0};
     pdu.proto_ver = DP_PROTO_VER_1;
     pdu.mtype = DP_MT_CLOSE;
@@ -473,7 +863,45 @@ void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) {
 }
 
 
+//// SEGMENT POOL
+static int dppool_init(dp_segpool *pool, int nsegs) {
+    pool->slab = malloc(nsegs * sizeof(dp_segment));
+    if (pool->slab == NULL) {
+        perror("dp segment pool allocation failed");
+        return DP_ERROR_GENERAL;
+    }
+    pool->nsegs = nsegs;
+    pool->freeList = NULL;
+    for (int i = nsegs - 1; i >= 0; i--)
+        dppool_put(pool, &pool->slab[i]);
+    return DP_NO_ERROR;
+}
+
+static void dppool_free(dp_segpool *pool) {
+    free(pool->slab);
+    pool->slab = NULL;
+    pool->freeList = NULL;
+    pool->nsegs = 0;
+}
+
+static dp_segment *dppool_get(dp_segpool *pool) {
+    dp_segment *seg = pool->freeList;
+    if (seg != NULL)
+        pool->freeList = seg->next;
+    return seg;
+}
+
+static void dppool_put(dp_segpool *pool, dp_segment *seg) {
+    seg->next = pool->freeList;
+    pool->freeList = seg;
+}
+
 //// MISC HELPERS
+static _Bool dpsameaddr(struct sockaddr_in *a, struct sockaddr_in *b) {
+    return (a->sin_addr.s_addr == b->sin_addr.s_addr) &&
+           (a->sin_port == b->sin_port);
+}
+
 void print_out_pdu(dp_pdu *pdu) {
     if (_debugMode != 1)
         return;
@@ -509,6 +937,8 @@ static char * pdu_msg_to_string(dp_pdu *pdu) {
             return "NACK";      
         case DP_MT_SNDACK:
             return "SEND/ACK";    
+        case (DP_MT_SND | DP_MT_FRAGMENT):
+            return "SEND/FRAGMENT";
         case DP_MT_CNTACK:
             return "CONNECT/ACK";    
         case DP_MT_CLOSEACK:
@@ -2,6 +2,7 @@
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 
 
 struct dp_sock{
@@ -10,17 +11,6 @@ struct dp_sock{
     struct sockaddr_in addr;
 };
 
-typedef struct dp_connection{
-    unsigned int       seqNum;
-    int                udp_sock;
-    _Bool              isConnected;
-    struct dp_sock     outSockAddr;
-    struct dp_sock     inSockAddr;
-    int                dbgMode;
-} dp_connection;
-
-typedef struct dp_connection *dp_connp;
-
 
 /*
  * Drexel Protocol (dp) PDU
@@ -60,6 +50,71 @@ typedef struct dp_pdu {
 
 #define     DP_MAX_BUFF_SZ          512
 #define     DP_MAX_DGRAM_SZ         (DP_MAX_BUFF_SZ + sizeof(dp_pdu))
+#define     DP_CONNECT_BACKLOG      16
+#define     DP_DEF_WINDOW           1       //1 = classic stop and wait
+#define     DP_MAX_WINDOW           64
+
+/*
+ * Segment pool.  A sender keeps every unacknowledged datagram around until its
+ * ACK arrives (the retransmit queue).  Rather than malloc/free per datagram,
+ * each connection carves one slab of window sized segments up front and
+ * recycles them through a free list, so the data path never allocates.
+ */
+typedef struct dp_segment {
+    struct dp_segment  *next;
+    int                 len;            //bytes used in dgram (pdu + payload)
+    char                dgram[DP_MAX_DGRAM_SZ];
+} dp_segment;
+
+typedef struct dp_segpool {
+    dp_segment         *slab;
+    dp_segment         *freeList;
+    int                 nsegs;
+} dp_segpool;
+
+//Traffic counters, kept per connection with plain increments.  A connection
+//adds its counts to the process totals (dptotals()) when it is closed
+typedef struct dp_stats {
+    long long          msgsSent;            //dpsend()/dpsendv() messages
+    long long          msgsRcvd;            //dprecv() messages
+    long long          dgramsSent;
+    long long          dgramsRcvd;
+    long long          bytesSent;           //on the wire, headers included
+    long long          bytesRcvd;
+    long long          syscalls;            //sendto()/recvfrom() calls
+} dp_stats;
+
+//Each connection owns its datagram buffer so that connections living on
+//different threads never share state on the datagram path
+typedef struct dp_connection{
+    unsigned int       seqNum;
+    int                udp_sock;
+    _Bool              isConnected;
+    struct dp_sock     outSockAddr;
+    struct dp_sock     inSockAddr;
+    int                dbgMode;
+    int                pendingCount;        //CONNECTs from other peers seen mid-session
+    dp_pdu             pendingConnect[DP_CONNECT_BACKLOG];
+    struct sockaddr_in pendingAddr[DP_CONNECT_BACKLOG];
+    char               dgramBuff[DP_MAX_DGRAM_SZ];
+    int                window;              //max unacknowledged datagrams
+    int                inFlight;
+    dp_segment         *inFlightHead;       //oldest unacknowledged datagram
+    dp_segment         *inFlightTail;
+    dp_segpool         pool;
+    int                spinUsec;            //busy poll budget before blocking, 0 = off
+    dp_stats           stats;
+} dp_connection;
+
+typedef struct dp_connection *dp_connp;
+
+//Read position in a gather list while it is cut into datagrams
+typedef struct dp_iovcursor {
+    const struct iovec *iov;
+    int                 iovcnt;
+    int                 idx;
+    size_t              off;
+} dp_iovcursor;
 
 #define     DP_NO_ERROR             0
 #define     DP_ERROR_GENERAL        -1
@@ -68,11 +123,14 @@ typedef struct dp_pdu {
 #define     DP_BUFF_OVERSIZED       -8
 #define     DP_CONNECTION_CLOSED    -16
 #define     DP_ERROR_BAD_DGRAM      -32
+#define     DP_ERROR_TIMEOUT        -64
 
 //PROTOTYPES - INTERNAL HELPERS
 static dp_connp dpinit();
+static void dpfree(dp_connp dpsession);
 
 dp_connp dpServerInit(int port);
+dp_connp dpServerInitShared(int port);
 dp_connp dpClientInit(char *addr, int port);
 static char * pdu_msg_to_string(dp_pdu *pdu);
 
@@ -80,9 +138,18 @@ static char * pdu_msg_to_string(dp_pdu *pdu);
 void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz);
 int dprecv(dp_connp dp, void *buff, int buff_sz);
 int dpsend(dp_connp dp, void *sbuff, int sbuff_sz);
+int dpsendv(dp_connp dp, const struct iovec *iov, int iovcnt);
 int dplisten(dp_connp dp);
+dp_connp dpaccept(dp_connp listener);
 int dpconnect(dp_connp dp);
 int dpdisconnect(dp_connp dp);
+int dpsetwindow(dp_connp dp, int window);
+int dpflush(dp_connp dp);
+int dpsetlowlatency(dp_connp dp, int spinUsec, int cpu);
+int dpsettimeout(dp_connp dp, int seconds);
+void dpdebug(int on);
+void dptotals(dp_stats *totals);
+void dpstats_diff(dp_stats *out, const dp_stats *now, const dp_stats *before);
 
 void dpclose(dp_connp dpsession);
 void print_out_pdu(dp_pdu *pdu);
@@ -92,4 +159,14 @@ static void print_pdu_details(dp_pdu *pdu);
 static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz);
 static int dprecvraw(dp_connp dp, void *buff, int buff_sz);
 static int dprecvdgram(dp_connp dp, void *buff, int buff_sz);
-static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz);
\ No newline at end of file
+static int dpsenddgram(dp_connp dp, dp_iovcursor *src, int sbuff_sz, _Bool isFragment);
+static dp_connp dpServerSetup(int port, _Bool reusePort);
+static int dppool_init(dp_segpool *pool, int nsegs);
+static void dppool_free(dp_segpool *pool);
+static dp_segment *dppool_get(dp_segpool *pool);
+static void dppool_put(dp_segpool *pool, dp_segment *seg);
+static int dpwaitack(dp_connp dp);
+static int dpnextconnect(dp_connp dp, dp_pdu *pdu);
+static int dprecvfrom(dp_connp dp, void *buff, int buff_sz,
+                      struct sockaddr_in *from, socklen_t *fromLen);
+static _Bool dpsameaddr(struct sockaddr_in *a, struct sockaddr_in *b);
\ No newline at end of file
@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "du-store.h"
+#include "du-hash.h"
+#include "du-io.h"
+
+#define DUSTORE_KEY_SEED1   0x243F6A8885A308D3ULL
+#define DUSTORE_KEY_SEED2   0x13198A2E03707344ULL
+#define DUSTORE_GEAR_SEED   0xA4093822299F31D0ULL
+
+dustore_key dustore_key_of(const void *data, int len){
+    dustore_key key = {
+        .h = { duhash_block(data, len, DUSTORE_KEY_SEED1),
+               duhash_block(data, len, DUSTORE_KEY_SEED2) }
+    };
+    return key;
+}
+
+/*
+ *  Content defined chunking with a gear hash.  Each byte shifts the hash
+ *  left and adds a random value for that byte, so the hash only depends on
+ *  the last 64 bytes and a boundary falls wherever its low bits are zero.
+ *  The table is filled from a fixed seed so every client cuts the same way.
+ */
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void){
+    uint64_t x = DUSTORE_GEAR_SEED;
+    for (int i = 0; i < 256; i++) {
+        //splitmix64
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+//Returns the number of chunks, *chunks is malloc'd, -1 on failure
+int dustore_chunk_file(const char *base, int64_t size, dustore_chunk **chunks){
+    const uint64_t mask = DUSTORE_AVG_CHUNK - 1;
+    int count = 0, capacity = size / DUSTORE_AVG_CHUNK + 16;
+    int64_t start = 0;
+
+    pthread_once(&gear_once, gear_init);
+    *chunks = malloc(capacity * sizeof(dustore_chunk));
+    if (*chunks == NULL)
+        return -1;
+
+    while (start < size) {
+        int64_t left = size - start;
+        int64_t len = (left < DUSTORE_MAX_CHUNK) ? left : DUSTORE_MAX_CHUNK;
+        if (len > DUSTORE_MIN_CHUNK) {
+            uint64_t hash = 0;
+            for (int64_t i = DUSTORE_MIN_CHUNK; i < len; i++) {
+                hash = (hash << 1) + gear[(unsigned char)base[start + i]];
+                if ((hash & (mask << 16)) == 0) {
+                    len = i + 1;
+                    break;
+                }
+            }
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            dustore_chunk *bigger = realloc(*chunks, capacity * sizeof(dustore_chunk));
+            if (bigger == NULL) {
+                free(*chunks);
+                *chunks = NULL;
+                return -1;
+            }
+            *chunks = bigger;
+        }
+        (*chunks)[count].key = dustore_key_of(base + start, len);
+        (*chunks)[count].offset = start;
+        (*chunks)[count].len = len;
+        count++;
+        start += len;
+    }
+    return count;
+}
+
+/*
+ *  The in memory index, an open addressed table keyed by chunk key.  The
+ *  same record layout is appended to the index file.
+ */
+typedef struct dustore_rec {
+    dustore_key key;
+    uint64_t    root;           //names the stored file holding the chunk
+    int64_t     offset;
+    int32_t     len;
+    int32_t     used;
+} dustore_rec;
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static char store_dir[256];
+static int store_log = -1;
+static dustore_rec *store_tab = NULL;
+static int64_t store_cap = 0;
+static int64_t store_count = 0;
+
+static dustore_rec *dustore_slot(dustore_rec *tab, int64_t cap, const dustore_key *key){
+    int64_t i = key->h[0] & (cap - 1);
+    while (tab[i].used && memcmp(&tab[i].key, key, sizeof(*key)) != 0)
+        i = (i + 1) & (cap - 1);
+    return &tab[i];
+}
+
+static int dustore_insert(const dustore_rec *rec){
+    if ((store_count + 1) * 2 > store_cap) {
+        int64_t cap = (store_cap == 0) ? 1024 : store_cap * 2;
+        dustore_rec *tab = calloc(cap, sizeof(dustore_rec));
+        if (tab == NULL)
+            return -1;
+        for (int64_t i = 0; i < store_cap; i++) {
+            if (store_tab[i].used)
+                *dustore_slot(tab, cap, &store_tab[i].key) = store_tab[i];
+        }
+        free(store_tab);
+        store_tab = tab;
+        store_cap = cap;
+    }
+    dustore_rec *slot = dustore_slot(store_tab, store_cap, &rec->key);
+    if (slot->used)
+        return 0;
+    *slot = *rec;
+    slot->used = 1;
+    store_count++;
+    return 1;
+}
+
+static void dustore_file_path(char *path, int path_sz, uint64_t root){
+    snprintf(path, path_sz, "%s/files/%016llx", store_dir, (unsigned long long)root);
+}
+
+int dustore_open(const char *dir){
+    char path[512];
+    dustore_rec rec;
+
+    pthread_mutex_lock(&store_lock);
+    snprintf(store_dir, sizeof(store_dir), "%s", dir);
+    snprintf(path, sizeof(path), "%s/files", dir);
+    if ((mkdir(dir, 0755) < 0 && errno != EEXIST) ||
+        (mkdir(path, 0755) < 0 && errno != EEXIST)) {
+        pthread_mutex_unlock(&store_lock);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/index", dir);
+    store_log = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (store_log < 0) {
+        pthread_mutex_unlock(&store_lock);
+        return -1;
+    }
+    while (read(store_log, &rec, sizeof(rec)) == sizeof(rec))
+        dustore_insert(&rec);
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
+
+/*
+ *  Writes the chunk with this key into fd at offset if the store has it.
+ *  The bytes are checked against the key on the way, so a stored file that
+ *  went missing or changed just reads as a chunk we do not have.
+ */
+int dustore_copy(const dustore_key *key, int len, int fd, int64_t offset){
+    char path[512];
+    dustore_rec rec;
+
+    pthread_mutex_lock(&store_lock);
+    bool found = false;
+    if (store_cap > 0) {
+        dustore_rec *slot = dustore_slot(store_tab, store_cap, key);
+        if (slot->used && slot->len == len) {
+            rec = *slot;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+    if (!found)
+        return -1;
+
+    dustore_file_path(path, sizeof(path), rec.root);
+    int src = open(path, O_RDONLY);
+    if (src < 0)
+        return -1;
+    char *buff = malloc(len);
+    int rc = -1;
+    if (buff != NULL && pread(src, buff, len, rec.offset) == len) {
+        dustore_key got = dustore_key_of(buff, len);
+        if (memcmp(&got, key, sizeof(got)) == 0)
+            rc = duio_dst_write(fd, buff, len, offset);
+    }
+    free(buff);
+    close(src);
+    return rc;
+}
+
+//True if the two files hold the same bytes
+static bool dustore_same(const char *a, const char *b){
+    duio_src sa, sb;
+    bool same = false;
+
+    if (duio_src_open(&sa, a) < 0)
+        return false;
+    if (duio_src_open(&sb, b) == 0) {
+        same = sa.size == sb.size &&
+               (sa.size == 0 || memcmp(sa.base, sb.base, sa.size) == 0);
+        duio_src_close(&sb);
+    }
+    duio_src_close(&sa);
+    return same;
+}
+
+//Makes dst a reflink of src with the given mode, -1 if extents cannot be shared
+static int dustore_clone(const char *src, const char *dst, mode_t mode){
+    int in = open(src, O_RDONLY);
+    if (in < 0)
+        return -1;
+    unlink(dst);
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, mode);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    int rc = ioctl(out, FICLONE, in);
+    close(in);
+    if (close(out) < 0 || rc < 0) {
+        unlink(dst);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Takes a verified upload into the store.  If the same bytes are stored
+ *  already the upload is swapped for a reflink of them, or for a hard link
+ *  when the store entry is writable, i.e. a hard link itself.  Otherwise the
+ *  upload becomes the stored copy the same way.  Chunks the index does not
+ *  know yet are then recorded as living in that copy.  The root is not a
+ *  strong hash, so a stored file under it is only trusted after a byte
+ *  compare; one that differs keeps its slot and the upload is not indexed.
+ */
+int dustore_commit(const char *path, uint64_t root, const dustore_chunk *chunks, int count){
+    char stored[512], tmp[sizeof(stored) + 8];
+    struct stat a, b;
+
+    dustore_file_path(stored, sizeof(stored), root);
+    if (stat(path, &b) < 0)
+        return -1;
+    if (stat(stored, &a) == 0) {
+        if (a.st_size != b.st_size || !dustore_same(stored, path))
+            return 0;
+        if (a.st_ino != b.st_ino) {
+            snprintf(tmp, sizeof(tmp), "%s.link", path);
+            if (dustore_clone(stored, tmp, b.st_mode & 0777) < 0 &&
+                (!(a.st_mode & S_IWUSR) || link(stored, tmp) < 0))
+                return 0;
+            if (rename(tmp, path) < 0)
+                unlink(tmp);
+        }
+    } else {
+        snprintf(tmp, sizeof(tmp), "%s.tmp", stored);
+        if (dustore_clone(path, tmp, 0444) == 0) {
+            if (rename(tmp, stored) < 0) {
+                unlink(tmp);
+                return -1;
+            }
+        } else if (link(path, stored) < 0) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&store_lock);
+    for (int i = 0; i < count; i++) {
+        dustore_rec rec = {
+            .key = chunks[i].key, .root = root,
+            .offset = chunks[i].offset, .len = chunks[i].len, .used = 1
+        };
+        if (dustore_insert(&rec) == 1 && store_log >= 0 &&
+            write(store_log, &rec, sizeof(rec)) != sizeof(rec))
+            perror("appending to the chunk index");
+    }
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * du-store: the server's content addressed chunk store for deduplicating
+ * uploads.  Files are cut into content defined chunks (a gear rolling hash
+ * picks the boundaries, so an insert only moves the chunks around it) and
+ * every chunk is keyed by a 128 bit hash of its bytes.  The key is two
+ * seeded duhash_block() passes, fast but not cryptographic, so a client that
+ * sets out to build a collision can get a stored chunk spliced into its own
+ * upload.  That is fine for trusted clients; anything else wants a real
+ * digest in dustore_key_of().
+ *
+ * Chunk data is never stored twice.  Each file that went through the store
+ * is kept once under <dir>/files/<root>: a read only reflink of the upload
+ * where the filesystem can share extents, otherwise a hard link to it.  A
+ * hard link shares the upload's inode and mode, so the store entry stays
+ * writable and a file edited in place just fails the key check in
+ * dustore_copy().  The index maps a chunk key to where the chunk lives in
+ * one of those files, it is an append only log in <dir>/index that is
+ * loaded into memory at start.
+ */
+#define DUSTORE_MIN_CHUNK   2048
+#define DUSTORE_AVG_CHUNK   8192        //must be a power of two
+#define DUSTORE_MAX_CHUNK   65536
+
+typedef struct dustore_key {
+    uint64_t h[2];
+} dustore_key;
+
+typedef struct dustore_chunk {
+    dustore_key key;
+    int64_t     offset;
+    int32_t     len;
+} dustore_chunk;
+
+int  dustore_chunk_file(const char *base, int64_t size, dustore_chunk **chunks);
+dustore_key dustore_key_of(const void *data, int len);
+
+int  dustore_open(const char *dir);
+int  dustore_copy(const dustore_key *key, int len, int fd, int64_t offset);
+int  dustore_commit(const char *path, uint64_t root, const dustore_chunk *chunks, int count);
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "du-tree.h"
+
+void dutree_init(dutree *tree){
+    memset(tree, 0, sizeof(dutree));
+}
+
+void dutree_free(dutree *tree){
+    for (int i = 0; i < tree->count; i++)
+        free(tree->ents[i].path);
+    free(tree->ents);
+    dutree_init(tree);
+}
+
+//Appends a file to the end of the stream
+int dutree_add(dutree *tree, const char *path, int64_t size){
+    if (size < 0)
+        return -1;
+    if (tree->count == tree->capacity) {
+        int capacity = (tree->capacity == 0) ? 64 : tree->capacity * 2;
+        dutree_ent *ents = realloc(tree->ents, capacity * sizeof(dutree_ent));
+        if (ents == NULL)
+            return -1;
+        tree->ents = ents;
+        tree->capacity = capacity;
+    }
+    dutree_ent *ent = &tree->ents[tree->count];
+    ent->path = strdup(path);
+    if (ent->path == NULL)
+        return -1;
+    ent->size = size;
+    ent->start = tree->total_size;
+    tree->total_size += size;
+    tree->count++;
+    return 0;
+}
+
+/*
+ *  nftw() has no user pointer, the walk is single threaded per call so the
+ *  tree being filled and the root prefix to strip are parked here.
+ */
+static __thread dutree *scan_tree;
+static __thread int scan_root_len;
+
+static int dutree_scan_ent(const char *fpath, const struct stat *sb, int type, struct FTW *ftw){
+    if (type != FTW_F || !S_ISREG(sb->st_mode))
+        return 0;
+    const char *rel = fpath + scan_root_len;
+    while (*rel == '/')
+        rel++;
+    return dutree_add(scan_tree, rel, sb->st_size);
+}
+
+//Collects every regular file below root, symlinks are not followed
+int dutree_scan(dutree *tree, const char *root){
+    scan_tree = tree;
+    scan_root_len = strlen(root);
+    return nftw(root, dutree_scan_ent, 32, FTW_PHYS);
+}
+
+/*
+ *  Packs as many entries as fit into buff starting at entry *next, and moves
+ *  *next past them.  Returns the bytes used.
+ */
+int dutree_encode(dutree *tree, int *next, char *buff, int buff_sz){
+    int used = 0;
+    while (*next < tree->count) {
+        dutree_ent *ent = &tree->ents[*next];
+        dutree_wire wire = { .size = ent->size, .path_len = strlen(ent->path) + 1 };
+        if (used + (int)sizeof(wire) + wire.path_len > buff_sz)
+            break;
+        memcpy(buff + used, &wire, sizeof(wire));
+        memcpy(buff + used + sizeof(wire), ent->path, wire.path_len);
+        used += sizeof(wire) + wire.path_len;
+        (*next)++;
+    }
+    return used;
+}
+
+//Appends the entries in one manifest PDU, -1 if it is malformed
+int dutree_decode(dutree *tree, const char *buff, int len){
+    int pos = 0;
+    while (pos < len) {
+        dutree_wire wire;
+        if (len - pos < (int)sizeof(wire))
+            return -1;
+        memcpy(&wire, buff + pos, sizeof(wire));
+        pos += sizeof(wire);
+        if (wire.path_len < 1 || wire.path_len > len - pos ||
+            buff[pos + wire.path_len - 1] != '\0')
+            return -1;
+        if (dutree_add(tree, buff + pos, wire.size) < 0)
+            return -1;
+        pos += wire.path_len;
+    }
+    return 0;
+}
+
+//Index of the file holding stream offset, files are sorted by start
+int dutree_find(dutree *tree, int64_t offset){
+    int lo = 0, hi = tree->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        dutree_ent *ent = &tree->ents[mid];
+        if (offset < ent->start)
+            hi = mid - 1;
+        else if (offset >= ent->start + ent->size)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return -1;
+}
+
+//A manifest path must stay below the root the receiver puts it in, and
+//name it one way only: no empty, "." or ".." components
+bool dutree_safe_path(const char *path){
+    if (path[0] == '\0' || path[0] == '/')
+        return false;
+    for (const char *p = path; *p != '\0'; ) {
+        const char *end = strchrnul(p, '/');
+        if (end == p || (end - p == 1 && p[0] == '.') ||
+            (end - p == 2 && p[0] == '.' && p[1] == '.'))
+            return false;
+        p = (*end == '/') ? end + 1 : end;
+    }
+    return true;
+}
+
+//Creates the directories leading up to the file at path
+int dutree_mkdirs(const char *path){
+    char buff[4096];
+    snprintf(buff, sizeof(buff), "%s", path);
+    for (char *p = buff + 1; *p != '\0'; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(buff, 0755) < 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * du-tree: the manifest behind directory transfers.  A tree is the list of
+ * regular files below a root, in a fixed order, each with its size and its
+ * start offset in the stream formed by concatenating all of them.  du-ftp
+ * sends that stream as ordinary DATA blocks, so many small files share a
+ * block and need no round trips of their own.
+ *
+ * On the wire a manifest is a run of entries, each a dutree_wire header
+ * followed by path_len bytes of path relative to the root (NUL included).
+ */
+typedef struct dutree_wire {
+    int64_t     size;
+    int32_t     path_len;
+} __attribute__((packed)) dutree_wire;
+
+typedef struct dutree_ent {
+    char        *path;          //relative to the root
+    int64_t     size;
+    int64_t     start;          //offset of the file's first byte in the stream
+} dutree_ent;
+
+typedef struct dutree {
+    dutree_ent  *ents;
+    int         count;
+    int         capacity;
+    int64_t     total_size;
+} dutree;
+
+void dutree_init(dutree *tree);
+void dutree_free(dutree *tree);
+int  dutree_add(dutree *tree, const char *path, int64_t size);
+int  dutree_scan(dutree *tree, const char *root);
+int  dutree_encode(dutree *tree, int *next, char *buff, int buff_sz);
+int  dutree_decode(dutree *tree, const char *buff, int len);
+int  dutree_find(dutree *tree, int64_t offset);
+bool dutree_safe_path(const char *path);
+int  dutree_mkdirs(const char *path);